@@ -8,13 +8,20 @@
 // Kernel Thread
 #include <linux/sched.h>
 #include <linux/kthread.h>
+// Per-CPU Scheduling
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/cpu.h>
 // System Calls
 #include <linux/syscalls.h> 
 #include <linux/fcntl.h>
 // Proc filesystem
 #include <linux/proc_fs.h>
+// Character Device
+#include <linux/miscdevice.h>
 // Filesystem I/O
 #include <linux/fs.h>
+#include <linux/seq_file.h>
 #include <linux/file.h> 
 #include <linux/buffer_head.h>
 #include <asm/segment.h>
@@ -24,18 +31,39 @@
 #include <linux/mm.h>
 // Spinlock
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
+// Lock-free Release List
+#include <linux/llist.h>
+#include <linux/atomic.h>
+// PID Lookup
+#include <linux/hashtable.h>
+#include <linux/rcupdate.h>
 // User Access
 #include <asm/uaccess.h>
 // Timer Libraries
 #include <linux/timer.h>
 #include <linux/jiffies.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
 // Type Libraries
 #include <linux/types.h>
 // String
 #include <linux/string.h>
 
+// Module Parameters
+#include <linux/moduleparam.h>
+
 // Given Functions
 #include "mp2_given.h"
+// Ready Queue
+#include "mp2_rq.h"
+// Admission Control
+#include "mp2_admit.h"
+// Periodic Job Accounting
+#include "mp2_job.h"
+// /dev/mp2 Interface
+#include "mp2_ioctl.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Group_ID");
@@ -44,41 +72,77 @@ MODULE_DESCRIPTION("CS-423 MP2");
 // Global Constants
 #define DEBUG 1
 #define FILENAME "status"
+#define STATSNAME "stats"
 #define DIRECTORY "mp2"
 #define BUFSIZE 128
 
 /**
  * Linux Kernel Linked List Struct
+ * list, pid_node and file are protected by lock, everything the scheduler
+ * touches by the lock of the task's CPU
  *
- * task_timer timer interrupt
+ * task_timer period release timer, absolute on CLOCK_MONOTONIC
+ * budget_timer fires once the running job used up its budget
  * list linux kernel linked list
- * linuxtask linux kernel task struct
+ * pid_node pid_table entry
+ * release_node released list entry of its CPU, queued by task_timer
+ * release_pending release_node is queued and not yet drained
+ * linuxtask linux kernel task struct, referenced while registered
  * pid user application pid
- * task_state user application state
+ * cpu CPU the task is partitioned onto
+ * affinity CPUs the task was allowed on before it was pinned to cpu
+ * file /dev/mp2 file the task is registered through, NULL for /proc
+ * task_state user application state, atomic so timers read it without a lock
  *    0 : SLEEP
  *    1 : READY
  *    2 : RUNNING
- * next_period time till next period
- * period user application period
- * runtime user application runtime
+ *    3 : EXITING, deregistered and waiting for its timer to be freed
+ *    4 : THROTTLED, job overran its runtime and runs SCHED_IDLE until its
+ *        next release
+ * job release grid and per-job counters, see mp2_job.h
+ * period user application period in microseconds
+ * runtime user application runtime in microseconds, the budget of every job
+ * budget budget left to the current job in nanoseconds
+ * run_start time the job was last put on the CPU
+ * over_budget budget_timer expired, the dispatcher throttles the job
+ * throttles jobs throttled for overrunning their budget
+ * rq_node ready queue node of its CPU, keyed on period or on the absolute
+ *    deadline of the current job under EDF
+ * admit_node admission control node of its CPU
 **/
 typedef struct mp2_task_struct {
-   struct timer_list task_timer;
+   struct hrtimer task_timer;
+   struct hrtimer budget_timer;
    struct list_head list;
+   struct hlist_node pid_node;
+   struct llist_node release_node;
+   atomic_t release_pending;
    struct task_struct* linuxtask;
+   struct mp2_rq_node rq_node;
+   struct mp2_admit_node admit_node;
    
    unsigned int pid;
-   unsigned int task_state;
-   uint64_t next_period;
+   int cpu;
+   struct cpumask affinity;
+   struct file * file;
+   atomic_t task_state;
+   struct mp2_job job;
    unsigned long period;
    unsigned long runtime; 
+   uint64_t budget;
+   uint64_t run_start;
+   int over_budget;
+   uint64_t throttles;
 } mp2_struct;
 
 // /proc/mp2/status
 static struct proc_dir_entry *proc_dir;
 static struct proc_dir_entry *proc_entry;
+static struct proc_dir_entry *proc_stats;
 
-// Linux Kernel Linked List
+// Linux Kernel Linked List, and the /proc pids hashed for O(1) lookup
+#define PID_HASH_BITS 8
+static DEFINE_HASHTABLE(pid_table, PID_HASH_BITS);
 static mp2_struct head;
 static mp2_struct *tmp;
 static struct list_head *pos, *q;
@@ -87,204 +151,557 @@ static int list_size = 0;
 // Slab Allocator
 static struct kmem_cache * kcache;
 
-// Semaphore Lock for /proc/mp2/status
+// Semaphore Lock for the task list and pid_table, never taken by the scheduler
 static spinlock_t lock;
 
-// Current Running Process
-static mp2_struct * current_process;
+// Maximum number of tasks partitioned onto one CPU
+static unsigned int max_tasks = 1024;
+module_param(max_tasks, uint, 0444);
+MODULE_PARM_DESC(max_tasks, "Maximum number of registered tasks per CPU (default 1024)");
+
+// Admission Control Policy, checked per CPU
+static int admission = MP2_ADMIT_LIU_LAYLAND;
+module_param(admission, int, 0444);
+MODULE_PARM_DESC(admission, "Admission test: 0 Liu-Layland bound (default), 1 hyperbolic bound, 2 exact response-time analysis");
+
+// Scheduling Policy, EDF always admits with the U <= 1 test
+#define MP2_POLICY_RM 0
+#define MP2_POLICY_EDF 1
+static int policy = MP2_POLICY_RM;
+module_param(policy, int, 0444);
+MODULE_PARM_DESC(policy, "Scheduling policy: 0 rate-monotonic (default), 1 earliest-deadline-first");
 
-// Admission Control Storage
-static unsigned long utilization;
+// Budget Enforcement, throttles jobs that overrun their declared runtime
+static int enforce_budget = 1;
+module_param(enforce_budget, int, 0444);
+MODULE_PARM_DESC(enforce_budget, "Throttle jobs that run past their declared runtime (default 1)");
 
-// Kernel Thread for Bottom Half
-struct task_struct * bottom_half;
-int bottom_half_running;
+#define MP2_LATENCY_BUCKETS 32
+
+/**
+ * Per-CPU Partitioned Scheduler
+ * admitted is protected by admit_lock, which only registration and
+ * deregistration take, so admission tests never hold up the scheduler. Every
+ * other field is protected by lock, nested inside the global lock when both
+ * are held
+ *
+ * lock scheduler lock of this CPU
+ * admit_lock admission control lock of this CPU, may sleep
+ * released tasks released by their timer and not yet queued, lock-free
+ * ready_queue READY tasks ordered by rate-monotonic priority
+ * admitted admitted task set of this CPU
+ * current_process task running on this CPU
+ * dispatcher bottom half kernel thread bound to this CPU
+ * cpu owning CPU
+ * latency release latency histogram, bucket i counts jobs first put on the
+ *    CPU [2^i, 2^(i+1)) nanoseconds after their release, bucket 0 also 0
+**/
+typedef struct mp2_cpu_struct {
+   spinlock_t lock;
+   struct mutex admit_lock;
+   struct llist_head released;
+   struct mp2_rq ready_queue;
+   struct mp2_admit admitted;
+   mp2_struct * current_process;
+   struct task_struct * dispatcher;
+   int cpu;
+   unsigned long latency[MP2_LATENCY_BUCKETS];
+} mp2_cpu;
+
+static DEFINE_PER_CPU(mp2_cpu, mp2_cpus);
+static struct cpumask sched_cpus;
+
+// Set once /dev/mp2 is registered
+static int mp2_dev_registered;
 
 // Bypass circular declaration
-static void queue_dispatch_thread(unsigned long data);
+static enum hrtimer_restart queue_dispatch_thread(struct hrtimer *timer);
+static enum hrtimer_restart budget_expired(struct hrtimer *timer);
 
 /**
- * Get Current Time in microseconds
+ * Get Current Monotonic Time in nanoseconds
  *
- * RETURN current time in microseconds
+ * RETURN current time in nanoseconds
 **/
-static unsigned long get_time(void){
-   struct timeval time;
-   do_gettimeofday(&time);
-   return time.tv_sec * 1000000L + time.tv_usec;
+static uint64_t get_time(void){
+   return ktime_get_ns();
 }
 
 /**
- * Proc Filesystem
- * Register User Application into RMS
+ * Partitioned scheduler of a task
  *
- * PARAM user_message string from user
+ * RETURN mp2_cpu the task is placed on
 **/
-static void proc_fs_register(char * user_message) {
-  int pid;
-  int tmp_utilization;
-  unsigned long period, runtime;
-
-  sscanf(user_message, "R, %d, %lu, %lu", &pid, &period, &runtime);
+static mp2_cpu * task_cpu_sched(mp2_struct * task){
+   return per_cpu_ptr(&mp2_cpus, task->cpu);
+}
 
-  // Check Admission Control Policy
-  tmp_utilization = utilization + (runtime * 1000) / period;
-  if (tmp_utilization > 693) {
-     if (DEBUG) { printk(KERN_ALERT "OVER UTILIZATION %d", tmp_utilization); }
-     return;
-  }
+/**
+ * Ready Queue key of a task under the scheduling policy
+ * Under EDF the deadline of the released job is its next release
+ *
+ * RETURN period for RM, absolute deadline in nanoseconds for EDF
+**/
+static uint64_t task_priority(mp2_struct * task){
+   if (policy == MP2_POLICY_EDF) { return task->job.next_period; }
+   return task->period;
+}
 
-  // Allocate new struct 
-  tmp = (mp2_struct *)kmem_cache_alloc(kcache, GFP_KERNEL);
-  tmp->task_state = 0;
-  tmp->pid = pid;
-  tmp->period = period;
-  tmp->runtime = runtime;
-  tmp->next_period = get_time() + tmp->period;
-  tmp->linuxtask = find_task_by_pid(tmp->pid);
-  setup_timer(&(tmp->task_timer), queue_dispatch_thread, (unsigned long) tmp);
+/**
+ * Period of a task in nanoseconds
+ *
+ * RETURN period in nanoseconds
+**/
+static uint64_t period_ns(mp2_struct * task){
+   return (uint64_t)task->period * NSEC_PER_USEC;
+}
 
-  // Update list_struct
-  utilization = tmp_utilization;
-  list_add_tail(&(tmp->list), &(head.list));
-  list_size++;
+/**
+ * Runtime of a task in nanoseconds, the budget of each of its jobs
+ *
+ * RETURN runtime in nanoseconds
+**/
+static uint64_t runtime_ns(mp2_struct * task){
+   return (uint64_t)task->runtime * NSEC_PER_USEC;
+}
 
-  if (DEBUG) { printk(KERN_ALERT "Registered %d", pid); }
+/**
+ * Starts charging a job for the CPU, lock of its CPU held
+ * Arms budget_timer for whatever budget the job has left
+ *
+ * PARAM task job put on the CPU
+**/
+static void budget_start(mp2_struct * task){
+   task->run_start = get_time();
+   if (enforce_budget)
+      hrtimer_start(&(task->budget_timer), ns_to_ktime(task->budget), HRTIMER_MODE_REL);
 }
 
 /**
- * Proc Filesystem
- * Deregister User Application from RMS
- * Frees mp2_struct tied to User Application
+ * Stops charging a job for the CPU, lock of its CPU held
+ * The timer callback takes the lock, so it is only tried to cancel here and
+ * a callback already running backs off once it sees the job is not RUNNING
  *
- * PARAM user_message string from user
+ * PARAM task job taken off the CPU
 **/
-static void proc_fs_deregister(char * user_message) {
-  int pid;
+static void budget_stop(mp2_struct * task){
+   uint64_t used = get_time() - task->run_start;
 
-  sscanf(user_message, "D, %d", &pid);
+   task->budget = used < task->budget ? task->budget - used : 0;
+   hrtimer_try_to_cancel(&(task->budget_timer));
+}
 
-  // Loop through looking for correct mp2_struct
-  list_for_each_safe(pos, q, &head.list) {
-    tmp = list_entry(pos, mp2_struct, list);
+/**
+ * Looks up a user application and references its task struct
+ *
+ * PARAM pid user application pid
+ * RETURN referenced linux kernel task struct, NULL if there is none
+**/
+static struct task_struct * mp2_get_task(int pid) {
+  struct task_struct * linuxtask;
+
+  rcu_read_lock();
+  linuxtask = pid_task(find_vpid(pid), PIDTYPE_PID);
+  if (linuxtask)
+    get_task_struct(linuxtask);
+  rcu_read_unlock();
+  return linuxtask;
+}
 
-    // Update Admission Control Policy
-    if(pid == tmp->pid) {
-      if (DEBUG) printk(KERN_INFO "PROCESS: %d DEREGISTERING", pid);
-      utilization -= (tmp->runtime * 1000) / tmp->period;
-      if (DEBUG) printk(KERN_ALERT "NEW UTILIZATION %lu", utilization); 
+/**
+ * Register Task into RMS, called without any lock, may sleep
+ * Places the task on the first CPU whose task set still admits it, testing
+ * and adding under one hold of that CPU's admit_lock, pins it there and only
+ * then makes it visible
+ *
+ * PARAM pid user application pid
+ * PARAM period user application period in microseconds
+ * PARAM runtime user application runtime
+ * PARAM file /dev/mp2 file the task is registered through, NULL for /proc
+ * RETURN admitted mp2_struct, NULL if not admitted
+**/
+static mp2_struct * mp2_register(int pid, unsigned long period, unsigned long runtime, struct file * file) {
+  int cpu, admitted = 0;
+  unsigned long flags;
+  struct task_struct * linuxtask;
+  mp2_struct * task;
+  mp2_cpu * cpu_sched;
 
-      // Free Memory
-      list_del(pos);
-      list_size--;
-      del_timer(&(tmp->task_timer));
-      kmem_cache_free(kcache,tmp);
-      tmp = NULL;
-      current_process = NULL;
+  linuxtask = mp2_get_task(pid);
+  if (linuxtask == NULL) { return NULL; }
 
-      // Start another process
-      wake_up_process(bottom_half);
-      if (DEBUG) printk(KERN_INFO "STARTED ANOTHER PROCESS");
-      
-      if (DEBUG) printk(KERN_ALERT "PROCESS: %d DEREGISTERED PROPERLY\n", pid);
-      return;
-    }
+  // Allocate new struct 
+  task = (mp2_struct *)kmem_cache_alloc(kcache, GFP_KERNEL);
+  if (task == NULL) {
+    put_task_struct(linuxtask);
+    return NULL;
   }
+  atomic_set(&(task->task_state), 0);
+  atomic_set(&(task->release_pending), 0);
+  task->pid = pid;
+  task->file = file;
+  task->period = period;
+  task->runtime = runtime;
+  mp2_job_init(&(task->job), get_time() + period_ns(task), period_ns(task));
+  task->budget = runtime_ns(task);
+  task->run_start = 0;
+  task->over_budget = 0;
+  task->throttles = 0;
+  task->linuxtask = linuxtask;
+  mp2_rq_node_init(&(task->rq_node), task_priority(task), pid);
+  mp2_admit_node_init(&(task->admit_node), period, runtime, pid);
+  hrtimer_init(&(task->task_timer), CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+  task->task_timer.function = queue_dispatch_thread;
+  hrtimer_init(&(task->budget_timer), CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+  task->budget_timer.function = budget_expired;
+
+  // Check Admission Control Policy, First-Fit over the online CPUs
+  for_each_cpu(cpu, &sched_cpus) {
+    cpu_sched = per_cpu_ptr(&mp2_cpus, cpu);
+    mutex_lock(&(cpu_sched->admit_lock));
+    admitted = mp2_admit_test(&(cpu_sched->admitted), &(task->admit_node), admission);
+    if (admitted)
+      mp2_admit_add(&(cpu_sched->admitted), &(task->admit_node), admission);
+    mutex_unlock(&(cpu_sched->admit_lock));
+    if (admitted) { break; }
+  }
+  if (!admitted) {
+     if (DEBUG) { printk(KERN_ALERT "NOT ADMITTED %d ON ANY CPU", pid); }
+     put_task_struct(linuxtask);
+     kmem_cache_free(kcache, task);
+     return NULL;
+  }
+  task->cpu = cpu;
+
+  // Pin to the partitioned CPU before anyone can schedule the task, a task
+  // its cpuset keeps off that CPU is not admitted
+  cpumask_copy(&(task->affinity), &(linuxtask->cpus_allowed));
+  if (set_cpus_allowed_ptr(linuxtask, cpumask_of(cpu))) {
+     if (DEBUG) { printk(KERN_ALERT "CANNOT PIN %d TO CPU %d", pid, cpu); }
+     mutex_lock(&(cpu_sched->admit_lock));
+     mp2_admit_remove(&(cpu_sched->admitted), &(task->admit_node));
+     mutex_unlock(&(cpu_sched->admit_lock));
+     put_task_struct(linuxtask);
+     kmem_cache_free(kcache, task);
+     return NULL;
+  }
+
+  // Update list_struct
+  spin_lock_irqsave(&lock, flags);
+  list_add_tail(&(task->list), &(head.list));
+  hash_add(pid_table, &(task->pid_node), pid);
+  list_size++;
+  spin_unlock_irqrestore(&lock, flags);
+
+  if (DEBUG) { printk(KERN_ALERT "Registered %d on CPU %d", pid, task->cpu); }
+  return task;
 }
 
 /**
- * Proc Filesystem
- * User Application Yield
+ * Unlinks a task from the task list and pid_table, lock held
+ * Whoever unlinks a task owns its deregistration
  *
- * PARAM user_message string from user
+ * PARAM task registered mp2_struct
 **/
-static void proc_fs_yield(char * user_message) {
-  int pid, ret;
-  long time_to_next_period;
-  mp2_struct * yield_process = NULL;
+static void mp2_unlink(mp2_struct * task) {
+  list_del(&(task->list));
+  hash_del(&(task->pid_node));
+  list_size--;
+}
 
-  sscanf(user_message, "Y, %d", &pid);
+/**
+ * Deregister Task from RMS, takes the admit_lock and then the lock of the
+ * task's CPU, may sleep
+ * The task must be unlinked already, the caller frees it with mp2_free
+ *
+ * PARAM task unlinked mp2_struct
+**/
+static void mp2_deregister(mp2_struct * task) {
+  unsigned long flags;
+  mp2_cpu * cpu_sched = task_cpu_sched(task);
+
+  // Update Admission Control Policy
+  if (DEBUG) printk(KERN_INFO "PROCESS: %d DEREGISTERING", task->pid);
+  mutex_lock(&(cpu_sched->admit_lock));
+  mp2_admit_remove(&(cpu_sched->admitted), &(task->admit_node));
+  if (DEBUG) printk(KERN_ALERT "NEW UTILIZATION %lu ON CPU %d", cpu_sched->admitted.utilization, task->cpu); 
+  mutex_unlock(&(cpu_sched->admit_lock));
+
+  // A timer already firing sees EXITING and backs off
+  spin_lock_irqsave(&(cpu_sched->lock), flags);
+  atomic_set(&(task->task_state), 3);
+  mp2_rq_remove(&(cpu_sched->ready_queue), &(task->rq_node));
+  if (cpu_sched->current_process == task)
+    cpu_sched->current_process = NULL;
+  spin_unlock_irqrestore(&(cpu_sched->lock), flags);
+
+  // Start another process
+  wake_up_process(cpu_sched->dispatcher);
+  if (DEBUG) printk(KERN_INFO "STARTED ANOTHER PROCESS");
+  
+  if (DEBUG) printk(KERN_ALERT "PROCESS: %d DEREGISTERED PROPERLY\n", task->pid);
+}
 
-  // Loop through to find Yielding mp2_struct
-  list_for_each_safe(pos, q, &head.list) {
-    tmp = list_entry(pos, mp2_struct, list);
+/**
+ * User Application Yield, takes the lock of the task's CPU
+ * Arms the release timer and sleeps the task until its next period
+ *
+ * PARAM task registered mp2_struct
+**/
+static void mp2_yield(mp2_struct * task) {
+  uint64_t now;
+  unsigned long flags;
+  mp2_cpu * cpu_sched = task_cpu_sched(task);
 
-    if (DEBUG) printk(KERN_INFO "SEARCHING FOR MATCH");
-    if (tmp->pid == pid){
-      if (DEBUG) printk(KERN_INFO "FOUND MATCH");
-      yield_process = tmp;
-      break;
-    }
+  if (DEBUG) printk(KERN_ALERT "PROCESS: %d YIELDING", task->pid);
+  spin_lock_irqsave(&(cpu_sched->lock), flags);
+  if (atomic_read(&(task->task_state)) == 3) {
+    spin_unlock_irqrestore(&(cpu_sched->lock), flags);
+    return;
   }
 
-  // Ensure Yield Process found
-  if (yield_process == NULL) { return; }
-  if (DEBUG) printk(KERN_ALERT "PROCESS: %d YIELDING", pid);
-
-  // Get Time to next period  
-  time_to_next_period = yield_process->next_period - get_time();
-  if (time_to_next_period < 0) {
+  // Job Completion, its deadline is the next release. A job that missed
+  // it sleeps until the first release after now, the overrun ones are skipped
+  now = get_time();
+  if (mp2_job_complete(&(task->job), now)) {
+    mp2_job_skip(&(task->job), now);
     if (DEBUG) printk(KERN_ALERT "Runtime > Period"); 
-    return;
   }
 
   // Set time
   if (DEBUG) printk(KERN_ALERT "STARTING TIMER");
-  ret = mod_timer(&(yield_process->task_timer), jiffies + msecs_to_jiffies(time_to_next_period / 1000));
+  hrtimer_start(&(task->task_timer), ns_to_ktime(task->job.next_period), HRTIMER_MODE_ABS);
 
   // Sleep task
-  yield_process->task_state = 0;
+  if (atomic_read(&(task->task_state)) == 2)
+    budget_stop(task);
+  atomic_set(&(task->task_state), 0);
+  mp2_rq_remove(&(cpu_sched->ready_queue), &(task->rq_node));
   if (DEBUG) printk(KERN_INFO "SETTING TASK STATE");
-  set_task_state(yield_process->linuxtask, TASK_UNINTERRUPTIBLE);
+  set_task_state(task->linuxtask, TASK_UNINTERRUPTIBLE);
+  spin_unlock_irqrestore(&(cpu_sched->lock), flags);
 
   if (DEBUG) printk(KERN_ALERT "SCHEDULING NEW FUNCTION");
-  wake_up_process(bottom_half);
+  wake_up_process(cpu_sched->dispatcher);
 
-  if (DEBUG) printk(KERN_ALERT "PROCESS: %d YIELDED PROPERLY\n", pid);
+  if (DEBUG) printk(KERN_ALERT "PROCESS: %d YIELDED PROPERLY\n", task->pid);
 }
 
 /**
- * Proc Filesystem
- * Loops through mp2_struct list printing all mp2_structs to user
+ * Moves the tasks released by their timers onto the Ready Queue, lock of
+ * the CPU held
+ * Under EDF the advanced next_period is also the deadline the job is queued on
  *
- * RETURN number of bytes left in buffer
+ * PARAM cpu_sched CPU whose released list is drained
 **/
-static ssize_t mp2_read(struct file *file, char __user *buffer, size_t count, loff_t *ppos){
-  int retval;
-  unsigned long flags;
-  if (DEBUG) printk(KERN_INFO "SENDING PIDS");
-  
-  //If ppos > 0, then that means this is the second time being called and all data has been sent 
-  //If list_size == 0, that means the list is empty and we should return immediately
-  if((int)*ppos > 0 || !list_size) { 
-    return 0; 
+static void mp2_drain(mp2_cpu * cpu_sched) {
+  struct llist_node * released = llist_del_all(&(cpu_sched->released));
+  mp2_struct * process, * next;
+
+  llist_for_each_entry_safe(process, next, released, release_node) {
+    atomic_set(&(process->release_pending), 0);
+    if (atomic_read(&(process->task_state)) == 3) { continue; }
+
+    atomic_set(&(process->task_state), 1);
+    process->budget = runtime_ns(process);
+    process->over_budget = 0;
+    mp2_job_release(&(process->job));
+    if (!mp2_rq_queued(&(process->rq_node))) {
+      process->rq_node.key = task_priority(process);
+      mp2_rq_push(&(cpu_sched->ready_queue), &(process->rq_node));
+    }
   }
+}
 
-	// Loops through mp2_struct list
-	spin_lock_irqsave(&lock, flags);
-  list_for_each_safe(pos, q, &head.list){
-    // Generate string
-    char my_buf[BUFSIZE];
-    tmp = list_entry(pos, mp2_struct, list);
-    sprintf(my_buf,"%d: %lu, %lu\n",tmp->pid,tmp->period, tmp->runtime);
-
-    // Copy to buffer
-    if(DEBUG) printk(KERN_ALERT "SENDING %s\n", my_buf);
-    if (copy_to_user(buffer + *ppos, my_buf, strlen(my_buf)+1)) {
-      return -EFAULT;
-    }
+/**
+ * Frees a deregistered mp2_struct, called without any lock
+ * Syncs both timers, then drains the released list of its CPU so the task
+ * cannot still be queued on it, and gives the task its affinity and the
+ * normal scheduling class back, whether it was RUNNING or THROTTLED
+ *
+ * PARAM task mp2_struct passed to mp2_deregister
+**/
+static void mp2_free(mp2_struct * task) {
+  struct sched_param sparam = { .sched_priority = 0 };
+  unsigned long flags;
+  mp2_cpu * cpu_sched = task_cpu_sched(task);
+
+  hrtimer_cancel(&(task->task_timer));
+  hrtimer_cancel(&(task->budget_timer));
+  spin_lock_irqsave(&(cpu_sched->lock), flags);
+  mp2_drain(cpu_sched);
+  spin_unlock_irqrestore(&(cpu_sched->lock), flags);
+  wake_up_process(cpu_sched->dispatcher);
+
+  sched_setscheduler(task->linuxtask, SCHED_NORMAL, &sparam);
+  set_cpus_allowed_ptr(task->linuxtask, &(task->affinity));
+  put_task_struct(task->linuxtask);
+  kmem_cache_free(kcache, task);
+}
+
+/**
+ * Finds a task registered through /proc, lock held
+ *
+ * PARAM pid user application pid
+ * RETURN mp2_struct, NULL if not registered
+**/
+static mp2_struct * proc_fs_find(int pid) {
+  mp2_struct * task;
 
-    // Update position
-    *ppos += strlen(my_buf);
+  hash_for_each_possible(pid_table, task, pid_node, pid) {
+    if (task->pid == pid && task->file == NULL)
+      return task;
   }
+  return NULL;
+}
+
+/**
+ * Proc Filesystem
+ * Register User Application into RMS
+ *
+ * PARAM user_message string from user
+**/
+static void proc_fs_register(char * user_message) {
+  int pid;
+  unsigned long period, runtime;
+
+  if (sscanf(user_message, "R, %d, %lu, %lu", &pid, &period, &runtime) != 3) { return; }
+  mp2_register(pid, period, runtime, NULL);
+}
+
+/**
+ * Proc Filesystem
+ * Deregister User Application from RMS
+ * Frees the mp2_struct tied to User Application
+ *
+ * PARAM user_message string from user
+**/
+static void proc_fs_deregister(char * user_message) {
+  int pid;
+  unsigned long flags;
+  mp2_struct * exiting;
+
+  if (sscanf(user_message, "D, %d", &pid) != 1) { return; }
+
+  spin_lock_irqsave(&lock, flags);
+  exiting = proc_fs_find(pid);
+  if (exiting) { mp2_unlink(exiting); }
+  spin_unlock_irqrestore(&lock, flags);
+
+  if (exiting == NULL) { return; }
+  mp2_deregister(exiting);
+  mp2_free(exiting);
+}
+
+/**
+ * Proc Filesystem
+ * User Application Yield
+ * The lock only keeps the task from being freed, the yield itself runs
+ * under the lock of its CPU
+ *
+ * PARAM user_message string from user
+**/
+static void proc_fs_yield(char * user_message) {
+  int pid;
+  unsigned long flags;
+  mp2_struct * yield_process;
+
+  if (sscanf(user_message, "Y, %d", &pid) != 1) { return; }
 
+  // Ensure Yield Process found
+  spin_lock_irqsave(&lock, flags);
+  yield_process = proc_fs_find(pid);
+  if (yield_process)
+    mp2_yield(yield_process);
   spin_unlock_irqrestore(&lock, flags);
-  //Makes sure that retval is not 0 and it is less than count so that buffer is sent back as intended
-  retval = count - *ppos;
-  if (DEBUG) printk(KERN_INFO "SENT PIDS");
-  return retval;
 }
 
+/**
+ * Proc Filesystem
+ * Status file iterator, streams one mp2_struct per step
+ * The lock is held for one read buffer at a time and seq_file resumes at *ppos
+**/
+static void *mp2_seq_start(struct seq_file *m, loff_t *pos){
+  spin_lock_irq(&lock);
+  return seq_list_start(&head.list, *pos);
+}
+
+static void *mp2_seq_next(struct seq_file *m, void *v, loff_t *pos){
+  return seq_list_next(v, &head.list, pos);
+}
+
+static void mp2_seq_stop(struct seq_file *m, void *v){
+  spin_unlock_irq(&lock);
+}
+
+/**
+ * Proc Filesystem
+ * Prints one mp2_struct to user
+ *
+ * RETURN 0
+**/
+static int mp2_seq_show(struct seq_file *m, void *v){
+  mp2_struct *task = list_entry(v, mp2_struct, list);
+  seq_printf(m, "%d: %lu, %lu, cpu %d\n", task->pid, task->period, task->runtime, task->cpu);
+  return 0;
+}
+
+static const struct seq_operations mp2_seq_ops = {
+  .start = mp2_seq_start,
+  .next = mp2_seq_next,
+  .stop = mp2_seq_stop,
+  .show = mp2_seq_show,
+};
+
+static int mp2_open(struct inode *inode, struct file *file){
+  return seq_open(file, &mp2_seq_ops);
+}
+
+/**
+ * Proc Filesystem
+ * Stats file, tasks listed under the lock
+ * Counters are read without the CPU locks, so a line may mix two updates
+ *
+ *    <pid>: <releases>, <completions>, <misses>, <worst response ns>, <throttles>, <skipped releases>
+ *    cpu <cpu>: <latency bucket 0> ... <latency bucket 31>
+ *
+ * RETURN 0
+**/
+static int mp2_stats_show(struct seq_file *m, void *v){
+  int cpu, i;
+  mp2_struct *task;
+  mp2_cpu * cpu_sched;
+
+  spin_lock_irq(&lock);
+  list_for_each_entry(task, &head.list, list) {
+    seq_printf(m, "%d: %llu, %llu, %llu, %llu, %llu, %llu\n", task->pid,
+               (unsigned long long)task->job.releases, (unsigned long long)task->job.completions,
+               (unsigned long long)task->job.misses, (unsigned long long)task->job.worst_response,
+               (unsigned long long)task->throttles, (unsigned long long)task->job.skipped);
+  }
+  for_each_cpu(cpu, &sched_cpus) {
+    cpu_sched = per_cpu_ptr(&mp2_cpus, cpu);
+    seq_printf(m, "cpu %d:", cpu);
+    for (i = 0; i < MP2_LATENCY_BUCKETS; i++)
+      seq_printf(m, " %lu", cpu_sched->latency[i]);
+    seq_putc(m, '\n');
+  }
+  spin_unlock_irq(&lock);
+  return 0;
+}
+
+static int mp2_stats_open(struct inode *inode, struct file *file){
+  return single_open(file, mp2_stats_show, NULL);
+}
+
+static const struct file_operations mp2_stats_file = {
+  .owner = THIS_MODULE,
+  .open = mp2_stats_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
 /**
  * Proc Filesystem
  * Recieves PID from user and inits new mp2_struct struct
@@ -292,16 +709,15 @@ static ssize_t mp2_read(struct file *file, char __user *buffer, size_t count, lo
  * RETURN copied data count
 **/
 static ssize_t mp2_write(struct file *file, const char __user *buffer, size_t count, loff_t *data){
-  int to_copy;
-  unsigned long flags;
-  char user_message[count];
+  size_t to_copy = min(count, (size_t)BUFSIZE - 1);
+  char user_message[BUFSIZE];
   if (DEBUG) printk(KERN_INFO "RECEIVING PID");
 
-  // Initialize memory for new linked list object
-  to_copy = copy_from_user(user_message, buffer, count);
+  // Copy and terminate the message, parsing happens before any lock is taken
+  if (copy_from_user(user_message, buffer, to_copy)) { return -EFAULT; }
+  user_message[to_copy] = '\0';
 
   // Proc FS systems
-  spin_lock_irqsave(&lock, flags);
   if (user_message[0] == 'R'){
     proc_fs_register(user_message);
   }
@@ -311,12 +727,10 @@ static ssize_t mp2_write(struct file *file, const char __user *buffer, size_t co
   else if (user_message[0] == 'Y') {
     proc_fs_yield(user_message);
   }
-  spin_unlock_irqrestore(&lock, flags);
-  if (DEBUG) printk(KERN_ALERT "UNLOCKING");
   if (DEBUG) printk(KERN_ALERT "PROCESS %c", user_message[0]);
 
-  *data += count - to_copy;
-  return count - to_copy;
+  *data += count;
+  return count;
 }
 
 /**
@@ -325,95 +739,293 @@ static ssize_t mp2_write(struct file *file, const char __user *buffer, size_t co
 **/
 static const struct file_operations mp2_file = {
   .owner = THIS_MODULE,
-  .read = mp2_read,
+  .open = mp2_open,
+  .read = seq_read,
   .write = mp2_write,
+  .llseek = seq_lseek,
+  .release = seq_release,
 };
 
+/**
+ * /dev/mp2
+ * Unlinks, deregisters and frees the task a handle holds
+ * RCU readers of private_data are waited out before the task is freed
+ *
+ * PARAM file handle
+ * RETURN 0 if successful, -EINVAL if the handle holds no task
+**/
+static int mp2_dev_deregister(struct file *file){
+  unsigned long flags;
+  mp2_struct * task = xchg(&(file->private_data), NULL);
+
+  if (task == NULL) { return -EINVAL; }
+  spin_lock_irqsave(&lock, flags);
+  mp2_unlink(task);
+  spin_unlock_irqrestore(&lock, flags);
+  synchronize_rcu();
+
+  mp2_deregister(task);
+  mp2_free(task);
+  return 0;
+}
+
+/**
+ * /dev/mp2
+ * Register, yield and deregister through ioctl on an open file
+ * The file is the handle, private_data points straight at its mp2_struct so
+ * a yield is one syscall, no lookup and only the lock of the task's CPU
+ *
+ * RETURN 0 if successful, negative errno otherwise
+**/
+static long mp2_dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg){
+  struct mp2_ioc_register reg;
+  mp2_struct * task;
+
+  switch (cmd) {
+    case MP2_IOC_REGISTER :
+      if (copy_from_user(&reg, (void __user *)arg, sizeof(reg)))
+        return -EFAULT;
+      if (reg.pid == 0)
+        reg.pid = task_pid_vnr(current);
+      if (READ_ONCE(file->private_data))
+        return -EBUSY;
+      task = mp2_register(reg.pid, reg.period, reg.runtime, file);
+      if (task == NULL)
+        return -ENOSPC;
+      // Lost a race with another registration on the same handle
+      if (cmpxchg(&(file->private_data), NULL, task) != NULL) {
+        unsigned long flags;
+        spin_lock_irqsave(&lock, flags);
+        mp2_unlink(task);
+        spin_unlock_irqrestore(&lock, flags);
+        mp2_deregister(task);
+        mp2_free(task);
+        return -EBUSY;
+      }
+      return 0;
+
+    case MP2_IOC_YIELD :
+      rcu_read_lock();
+      task = READ_ONCE(file->private_data);
+      if (task)
+        mp2_yield(task);
+      rcu_read_unlock();
+      return task ? 0 : -EINVAL;
+
+    case MP2_IOC_DEREGISTER :
+      return mp2_dev_deregister(file);
+
+    default :
+      return -ENOTTY;
+  }
+}
+
+/**
+ * /dev/mp2
+ * Closing the handle deregisters the task it still holds
+**/
+static int mp2_dev_release(struct inode *inode, struct file *file){
+  mp2_dev_deregister(file);
+  return 0;
+}
+
+/**
+ * /dev/mp2
+ * Function Setup
+**/
+static const struct file_operations mp2_dev_file = {
+  .owner = THIS_MODULE,
+  .unlocked_ioctl = mp2_dev_ioctl,
+  .compat_ioctl = mp2_dev_ioctl,
+  .release = mp2_dev_release,
+};
+
+static struct miscdevice mp2_dev = {
+  .minor = MISC_DYNAMIC_MINOR,
+  .name = MP2_DEV_NAME,
+  .fops = &mp2_dev_file,
+  .mode = 0666,
+};
+
+/**
+ * Counts one release latency in the histogram of a CPU, lock held
+ *
+ * PARAM cpu_sched CPU the job was put on
+ * PARAM latency release to first dispatch time in nanoseconds
+**/
+static void mp2_latency_add(mp2_cpu * cpu_sched, uint64_t latency){
+  int bucket = latency ? ilog2(latency) : 0;
+
+  if (bucket >= MP2_LATENCY_BUCKETS)
+    bucket = MP2_LATENCY_BUCKETS - 1;
+  cpu_sched->latency[bucket]++;
+}
+
 /**
  * Interrupt Bottom Half
- * Runs on alternate kernel thread, exits when bottom_half_running flag is false
+ * Runs on one kernel thread per CPU until kthread_stop
+ * Only schedules the tasks partitioned onto its CPU
+ * The thread marks itself sleeping before each pass, so a wakeup that lands
+ * anywhere in the pass makes the following schedule() return at once
  * 
- * Finds the process with the shortest period and runs it
+ * Finds the process with the shortest period, or the earliest deadline under
+ * EDF, and runs it
  * If there is a running process, sleep it unless it is past its period
  * Called whenever any process has its task_state changed
  *
- * PARAM data irrelevant, in place to avoid errors
+ * PARAM data mp2_cpu of the CPU this dispatcher is bound to
 **/
 static int dispatch_thread(void * data){
   struct sched_param sparam;
   unsigned long flags;
+  struct mp2_rq_node * node;
   mp2_struct * shortest_period;
+  mp2_cpu * cpu_sched = data;
+  mp2_struct * current_process;
   if (DEBUG) { printk(KERN_ALERT "dispatch_thread started"); }
 
-  while(bottom_half_running) {
+  while(!kthread_should_stop()) {
+    set_current_state(TASK_INTERRUPTIBLE);
     if (DEBUG) { printk(KERN_ALERT "INTERRUPT BOTTOM HALF"); }
     
-    // Mutex Lock
-    spin_lock_irqsave(&lock, flags);
-
-    // Find Process with shortest period
-    shortest_period = NULL;
-    list_for_each_safe(pos, q, &head.list) {
-      tmp = list_entry(pos, mp2_struct, list);
-      if (tmp->task_state == 1 && (shortest_period == NULL || tmp->period < shortest_period->period))
-        shortest_period = tmp;
-    } 
-
-    // If none are READY, return
-    if (shortest_period == NULL) {
-      spin_unlock_irqrestore(&lock, flags);
-      goto SLEEP;
+    // Mutex Lock, only this CPU's
+    spin_lock_irqsave(&(cpu_sched->lock), flags);
+
+    // Queue the jobs released since the last pass
+    mp2_drain(cpu_sched);
+
+    // Throttle a job that overran its budget until its next release. The
+    // job never yielded, so its release timer is armed here, past the
+    // releases it already overran
+    current_process = cpu_sched->current_process;
+    if (current_process != NULL && atomic_read(&(current_process->task_state)) == 2 && current_process->over_budget) {
+      if (DEBUG) printk(KERN_ALERT "THROTTLING %d", current_process->pid);
+      atomic_set(&(current_process->task_state), 4);
+      current_process->throttles++;
+      cpu_sched->current_process = NULL;
+      sparam.sched_priority = 0;
+      sched_setscheduler(current_process->linuxtask, SCHED_IDLE, &sparam);
+      mp2_job_skip(&(current_process->job), get_time());
+      hrtimer_start(&(current_process->task_timer), ns_to_ktime(current_process->job.next_period), HRTIMER_MODE_ABS);
     }
 
-    // Update Current Running Process
-    if (current_process != NULL && current_process->task_state == 2) {
-      if (current_process->period < shortest_period->period) {
-        spin_unlock_irqrestore(&lock, flags);
-        goto SLEEP;
-      }
-      else {
-        // Sets to READY
-        current_process->task_state = 1;
-        sparam.sched_priority = 0;
-        sched_setscheduler(current_process->linuxtask, SCHED_NORMAL, &sparam);
-      }
+    // Highest priority process is the head of the Ready Queue, it runs if
+    // it beats the running process
+    current_process = cpu_sched->current_process;
+    if (current_process != NULL && atomic_read(&(current_process->task_state)) != 2)
+      current_process = NULL;
+    node = mp2_rq_pick(&(cpu_sched->ready_queue), current_process ? &(current_process->rq_node) : NULL);
+
+    // If none should run, return
+    if (node == NULL) {
+      spin_unlock_irqrestore(&(cpu_sched->lock), flags);
+      goto SLEEP;
+    }
+    shortest_period = container_of(node, mp2_struct, rq_node);
+
+    // Update Current Running Process, sets it to READY
+    if (current_process != NULL) {
+      budget_stop(current_process);
+      atomic_set(&(current_process->task_state), 1);
+      mp2_rq_push(&(cpu_sched->ready_queue), &(current_process->rq_node));
+      sparam.sched_priority = 0;
+      sched_setscheduler(current_process->linuxtask, SCHED_NORMAL, &sparam);
     }
     
     // Wakes new process
     if (DEBUG) printk(KERN_ALERT "WAKING NEW PROCESS");
     current_process = shortest_period;
-    current_process->task_state = 2;
+    cpu_sched->current_process = current_process;
+    atomic_set(&(current_process->task_state), 2);
+    if (mp2_job_start(&(current_process->job)))
+      mp2_latency_add(cpu_sched, get_time() - current_process->job.release_time);
+    mp2_rq_remove(&(cpu_sched->ready_queue), node);
+    budget_start(current_process);
     wake_up_process(current_process->linuxtask);
     sparam.sched_priority = 99;
     sched_setscheduler(current_process->linuxtask, SCHED_FIFO, &sparam);
-    spin_unlock_irqrestore(&lock, flags);
+    spin_unlock_irqrestore(&(cpu_sched->lock), flags);
 
-    // Sleep, wait for next wake up
+    // Sleep, wait for next wake up unless a release or a stop came in
     SLEEP:
-    set_task_state(bottom_half, TASK_INTERRUPTIBLE);
-    schedule();
+    if (llist_empty(&(cpu_sched->released)) && !kthread_should_stop())
+      schedule();
+    __set_current_state(TASK_RUNNING);
   }
   return 0;
 }
 
 /**
  * Interrupt Top Half
- * Timer Interrupt callback function
- * Sets process to READY and calls bottom half
+ * Period release hrtimer callback function
+ * Lock-free, pushes the process onto the released list of its CPU and calls
+ * the bottom half, which sets it READY and advances next_period by one period
+ * A release already pending is not queued twice
  * 
- * PARAM data mp2_struct pointer address to appropriate mp2_struct
+ * PARAM timer task_timer of the released mp2_struct
+ * RETURN HRTIMER_NORESTART, the next yield or throttle rearms the timer
 **/
-static void queue_dispatch_thread(unsigned long data){
+static enum hrtimer_restart queue_dispatch_thread(struct hrtimer *timer){
   mp2_struct * process;
+  mp2_cpu * cpu_sched;
   if (DEBUG) { printk(KERN_ALERT "queue_dispatch start"); }
 
-  // Update Process Information
-  process = (mp2_struct *) data;
-  process->task_state = 1;
-  process->next_period = get_time() + process->period;
+  process = container_of(timer, mp2_struct, task_timer);
+  if (atomic_read(&(process->task_state)) == 3) { return HRTIMER_NORESTART; }
+  if (atomic_xchg(&(process->release_pending), 1)) { return HRTIMER_NORESTART; }
+
+  cpu_sched = task_cpu_sched(process);
+  llist_add(&(process->release_node), &(cpu_sched->released));
 
   if (DEBUG) { printk(KERN_ALERT "WAKE BOTTOM HALF %d", process->pid); }
-  wake_up_process(bottom_half);
+  wake_up_process(cpu_sched->dispatcher);
+  return HRTIMER_NORESTART;
+}
+
+/**
+ * Budget hrtimer callback function
+ * Flags the running job as over budget and calls the bottom half, which
+ * throttles it since the scheduling class cannot change in interrupt context
+ * A stale expiry, for a job preempted or re-dispatched since, backs off
+ *
+ * PARAM timer budget_timer of the running mp2_struct
+ * RETURN HRTIMER_NORESTART, the next dispatch rearms the timer
+**/
+static enum hrtimer_restart budget_expired(struct hrtimer *timer){
+  mp2_struct * process;
+  mp2_cpu * cpu_sched;
+  unsigned long flags;
+
+  process = container_of(timer, mp2_struct, budget_timer);
+  cpu_sched = task_cpu_sched(process);
+  spin_lock_irqsave(&(cpu_sched->lock), flags);
+  if (atomic_read(&(process->task_state)) != 2 || get_time() - process->run_start < process->budget) {
+    spin_unlock_irqrestore(&(cpu_sched->lock), flags);
+    return HRTIMER_NORESTART;
+  }
+  process->budget = 0;
+  process->over_budget = 1;
+  spin_unlock_irqrestore(&(cpu_sched->lock), flags);
+
+  if (DEBUG) { printk(KERN_ALERT "BUDGET EXPIRED %d", process->pid); }
+  wake_up_process(cpu_sched->dispatcher);
+  return HRTIMER_NORESTART;
+}
+
+/**
+ * Frees the per-CPU Ready Queue and Admission Control storage
+**/
+static void mp2_free_cpus(void){
+   int cpu;
+   mp2_cpu * cpu_sched;
+
+   for_each_cpu(cpu, &sched_cpus) {
+      cpu_sched = per_cpu_ptr(&mp2_cpus, cpu);
+      kfree(cpu_sched->ready_queue.heap);
+      kfree(cpu_sched->admitted.tasks);
+      cpu_sched->ready_queue.heap = NULL;
+      cpu_sched->admitted.tasks = NULL;
+   }
 }
 
 /**
@@ -423,6 +1035,15 @@ static void queue_dispatch_thread(unsigned long data){
 **/
 int __init mp2_init(void)
 {
+   int cpu, ret;
+   mp2_cpu * cpu_sched;
+   struct task_struct * dispatcher;
+   struct mp2_rq_node ** rq_storage;
+   struct mp2_admit_node ** admit_storage;
+
+   // EDF is exact up to full utilization, RM tests do not apply to it
+   if (policy == MP2_POLICY_EDF) { admission = MP2_ADMIT_EDF; }
+
    #ifdef DEBUG
    printk(KERN_INFO "MP1 MODULE LOADING\n");
    #endif
@@ -431,10 +1052,29 @@ int __init mp2_init(void)
    spin_lock_init(&lock);
    printk(KERN_INFO "INITIALIZED SPINLOCK\n");
 
-   // Creates /proc/mp2/status
-   proc_dir = proc_mkdir(DIRECTORY, NULL);
-   proc_entry = proc_create(FILENAME, 0666, proc_dir, &mp2_file);  
-   if (DEBUG) printk(KERN_INFO "CREATED /proc/mp2/status \n");
+   // initializes the per-CPU Ready Queues and Admission Control task sets
+   get_online_cpus();
+   cpumask_copy(&sched_cpus, cpu_online_mask);
+   put_online_cpus();
+   for_each_cpu(cpu, &sched_cpus) {
+      cpu_sched = per_cpu_ptr(&mp2_cpus, cpu);
+      rq_storage = kcalloc(max_tasks, sizeof(struct mp2_rq_node *), GFP_KERNEL);
+      admit_storage = kcalloc(max_tasks, sizeof(struct mp2_admit_node *), GFP_KERNEL);
+      if (!rq_storage || !admit_storage) {
+         kfree(rq_storage);
+         kfree(admit_storage);
+         mp2_free_cpus();
+         return -ENOMEM;
+      }
+      mp2_rq_init(&(cpu_sched->ready_queue), rq_storage, max_tasks);
+      mp2_admit_init(&(cpu_sched->admitted), admit_storage, max_tasks);
+      spin_lock_init(&(cpu_sched->lock));
+      mutex_init(&(cpu_sched->admit_lock));
+      init_llist_head(&(cpu_sched->released));
+      cpu_sched->current_process = NULL;
+      cpu_sched->dispatcher = NULL;
+      cpu_sched->cpu = cpu;
+   }
 
    // initializes mp2_struct head
    INIT_LIST_HEAD(&head.list);
@@ -443,20 +1083,59 @@ int __init mp2_init(void)
    // initializes the slab allocator
    if (DEBUG) printk(KERN_INFO "INITIALIZED slab allocator\n");
    kcache = kmem_cache_create("mp2_struct",sizeof(mp2_struct),0,0,NULL);
+   if (kcache == NULL) {
+      ret = -ENOMEM;
+      goto out_cpus;
+   }
 
-   // Create Bottom Half Kernel Thread
-   bottom_half = kthread_create(&dispatch_thread, NULL, "bottomhalf");
-   get_task_struct(bottom_half);
-   bottom_half_running = 1;
+   // Create one Bottom Half Kernel Thread per CPU
+   for_each_cpu(cpu, &sched_cpus) {
+      cpu_sched = per_cpu_ptr(&mp2_cpus, cpu);
+      dispatcher = kthread_create(&dispatch_thread, cpu_sched, "bottomhalf/%d", cpu);
+      if (IS_ERR(dispatcher)) {
+         ret = PTR_ERR(dispatcher);
+         goto out_threads;
+      }
+      kthread_bind(dispatcher, cpu);
+      get_task_struct(dispatcher);
+      cpu_sched->dispatcher = dispatcher;
+   }
 
-   // Initialize running process pointer
-   current_process = NULL;
+   // Creates /proc/mp2/status once every dispatcher exists, a registration
+   // can wake its CPU's dispatcher straight away
+   proc_dir = proc_mkdir(DIRECTORY, NULL);
+   proc_entry = proc_create(FILENAME, 0666, proc_dir, &mp2_file);  
+   proc_stats = proc_create(STATSNAME, 0444, proc_dir, &mp2_stats_file);
+   if (DEBUG) printk(KERN_INFO "CREATED /proc/mp2/status \n");
 
-   // Initialize Admission Control Variable
-   utilization = 0;
+   // Creates /dev/mp2, /proc/mp2/status keeps working without it
+   if (misc_register(&mp2_dev)) {
+      printk(KERN_WARNING "mp2: /dev/mp2 unavailable, /proc/mp2/status only\n");
+      mp2_dev_registered = 0;
+   }
+   else {
+      mp2_dev_registered = 1;
+      if (DEBUG) printk(KERN_INFO "CREATED /dev/mp2\n");
+   }
 
    if (DEBUG) printk(KERN_ALERT "MP1 MODULE LOADED\n");
    return 0;   
+
+   // Unwinds a failed load, the dispatchers never ran a task
+out_threads:
+   for_each_cpu(cpu, &sched_cpus) {
+      cpu_sched = per_cpu_ptr(&mp2_cpus, cpu);
+      if (cpu_sched->dispatcher == NULL)
+         continue;
+      kthread_stop(cpu_sched->dispatcher);
+      put_task_struct(cpu_sched->dispatcher);
+      cpu_sched->dispatcher = NULL;
+   }
+   kmem_cache_destroy(kcache);
+out_cpus:
+   mp2_free_cpus();
+   printk(KERN_ERR "mp2: failed to load, error %d\n", ret);
+   return ret;
 }
 
 /**
@@ -466,32 +1145,56 @@ int __init mp2_init(void)
 **/
 void __exit mp2_exit(void)
 {
+   struct sched_param sparam = { .sched_priority = 0 };
+   int cpu;
+   mp2_cpu * cpu_sched;
+
    #ifdef DEBUG
    printk(KERN_ALERT "MP1 MODULE UNLOADING\n");
    #endif
 
+   // Deletes /dev/mp2, no file can still be open while the module unloads
+   if (mp2_dev_registered) { misc_deregister(&mp2_dev); }
+
    // Deletes /proc/mp2/status
+   proc_remove(proc_stats);
    proc_remove(proc_entry);
    proc_remove(proc_dir);
    if (DEBUG) printk(KERN_INFO "DELETED /proc/mp2/status\n");
 
-   // Frees mp2_struct memory   
+   // Exits Bottom Half Kernel Threads, references stay held so a timer
+   // still firing below can wake them safely
+   for_each_cpu(cpu, &sched_cpus) {
+      kthread_stop(per_cpu_ptr(&mp2_cpus, cpu)->dispatcher);
+   }
+
+   // Frees mp2_struct memory, tasks get the normal class and their affinity back
+   list_for_each_safe(pos, q, &head.list){
+       tmp = list_entry(pos, mp2_struct, list);
+       atomic_set(&(tmp->task_state), 3);
+       hrtimer_cancel(&(tmp->task_timer));
+       hrtimer_cancel(&(tmp->budget_timer));
+   }
    list_for_each_safe(pos, q, &head.list){
        tmp = list_entry(pos, mp2_struct, list);
-       del_timer(&(tmp->task_timer));
        list_del(pos);
+       sched_setscheduler(tmp->linuxtask, SCHED_NORMAL, &sparam);
+       set_cpus_allowed_ptr(tmp->linuxtask, &(tmp->affinity));
+       put_task_struct(tmp->linuxtask);
        kmem_cache_free(kcache,tmp);
    }
    if (DEBUG) printk(KERN_INFO "DELETED pid_list struct\n");
 
-   // destroys the slab allocator
+   // destroys the slab allocator and the Ready Queue
    kmem_cache_destroy(kcache);
+   mp2_free_cpus();
    if (DEBUG) printk(KERN_INFO "DESTROYED slab allocator\n");
 
-   // Exits Bottom Half Kernel Thread
-   bottom_half_running = 0;
-   kthread_stop(bottom_half);
-   put_task_struct(bottom_half);
+   // Drops the Bottom Half Kernel Thread references
+   for_each_cpu(cpu, &sched_cpus) {
+      cpu_sched = per_cpu_ptr(&mp2_cpus, cpu);
+      put_task_struct(cpu_sched->dispatcher);
+   }
 
    if (DEBUG) printk(KERN_ALERT "MP1 MODULE UNLOADED\n");
 }
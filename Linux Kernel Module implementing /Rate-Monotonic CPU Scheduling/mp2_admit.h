@@ -0,0 +1,258 @@
+#ifndef __MP2_ADMIT_INCLUDE__
+#define __MP2_ADMIT_INCLUDE__
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/math64.h>
+#define MP2_DIV64(a, b) div64_u64((a), (b))
+#else
+#include <stddef.h>
+#include <stdint.h>
+#define MP2_DIV64(a, b) ((a) / (b))
+#endif
+
+/**
+ * Admission Control
+ * Keeps the admitted task set sorted by rate-monotonic priority and tests a
+ * new task against it without a full recomputation
+ *
+ *    MP2_ADMIT_LIU_LAYLAND sum(U) <= 0.693, per-mille as before
+ *    MP2_ADMIT_HYPERBOLIC  prod(U + 1) <= 2, product kept incrementally
+ *    MP2_ADMIT_RTA         exact response-time analysis, a new task only
+ *                          re-iterates lower priority tasks, starting from
+ *                          their cached response time plus its runtime
+ *    MP2_ADMIT_EDF         sum(U) <= 1, the schedulability condition of
+ *                          earliest-deadline-first with deadlines equal to
+ *                          periods, each U rounded up to parts per million
+ *                          so rounding never admits an overloaded set
+ *
+ * Storage is handed in by the caller, nothing here allocates or locks
+**/
+#define MP2_ADMIT_LIU_LAYLAND 0
+#define MP2_ADMIT_HYPERBOLIC 1
+#define MP2_ADMIT_RTA 2
+#define MP2_ADMIT_EDF 3
+
+#define MP2_ADMIT_LL_BOUND 693
+#define MP2_ADMIT_PPM 1000000ULL
+
+/**
+ * Admission Node, embedded in the scheduled task
+ *
+ * period task period, also its relative deadline
+ * runtime task worst case runtime, same unit as period
+ * tiebreak orders equal periods, the task pid
+ * response cached worst case response time
+ * candidate response time if the task under test is admitted
+**/
+struct mp2_admit_node {
+  uint64_t period;
+  uint64_t runtime;
+  unsigned int tiebreak;
+  uint64_t response;
+  uint64_t candidate;
+};
+
+/**
+ * Admitted Task Set
+ *
+ * tasks admitted nodes, highest priority first
+ * nr admitted tasks
+ * capacity length of tasks
+ * utilization sum of per-mille utilizations
+ * utilization_ppm sum of utilizations in parts per million, each rounded up
+ * hyperbolic prod(U + 1) in parts per million, rounded up
+**/
+struct mp2_admit {
+  struct mp2_admit_node **tasks;
+  int nr;
+  int capacity;
+  unsigned long utilization;
+  uint64_t utilization_ppm;
+  uint64_t hyperbolic;
+};
+
+static inline void mp2_admit_init(struct mp2_admit *set, struct mp2_admit_node **storage, int capacity){
+  set->tasks = storage;
+  set->nr = 0;
+  set->capacity = capacity;
+  set->utilization = 0;
+  set->utilization_ppm = 0;
+  set->hyperbolic = MP2_ADMIT_PPM;
+}
+
+static inline void mp2_admit_node_init(struct mp2_admit_node *node, uint64_t period, uint64_t runtime, unsigned int tiebreak){
+  node->period = period;
+  node->runtime = runtime;
+  node->tiebreak = tiebreak;
+  node->response = runtime;
+  node->candidate = runtime;
+}
+
+/**
+ * RETURN per-mille utilization of a node
+**/
+static inline unsigned long mp2_admit_util(const struct mp2_admit_node *node){
+  return (unsigned long)MP2_DIV64(node->runtime * 1000, node->period);
+}
+
+/**
+ * RETURN utilization of a node in parts per million, rounded up
+**/
+static inline uint64_t mp2_admit_util_ppm(const struct mp2_admit_node *node){
+  return MP2_DIV64(node->runtime * MP2_ADMIT_PPM + node->period - 1, node->period);
+}
+
+/**
+ * RETURN prod * (U + 1) in parts per million, rounded up
+**/
+static inline uint64_t mp2_admit_hyper_mul(uint64_t prod, const struct mp2_admit_node *node){
+  uint64_t factor = MP2_ADMIT_PPM + mp2_admit_util_ppm(node);
+  return MP2_DIV64(prod * factor + MP2_ADMIT_PPM - 1, MP2_ADMIT_PPM);
+}
+
+/**
+ * RETURN 1 if a has a strictly higher rate-monotonic priority than b
+**/
+static inline int mp2_admit_before(const struct mp2_admit_node *a, const struct mp2_admit_node *b){
+  if (a->period != b->period)
+    return a->period < b->period;
+  return a->tiebreak < b->tiebreak;
+}
+
+/**
+ * RETURN index the node takes in the priority ordered task set
+**/
+static inline int mp2_admit_slot(const struct mp2_admit *set, const struct mp2_admit_node *node){
+  int lo = 0, hi = set->nr;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (mp2_admit_before(set->tasks[mid], node))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/**
+ * Fixed point iteration R = C + sum(ceil(R / Tj) * Cj) over higher priority tasks
+ *
+ * PARAM set admitted tasks, tasks[0..slot) are the higher priority ones
+ * PARAM slot priority position of the task under analysis
+ * PARAM extra additional higher priority task, or NULL
+ * PARAM node task under analysis
+ * PARAM start lower bound to start iterating from
+ * RETURN response time, or period + 1 once it misses its deadline
+**/
+static inline uint64_t mp2_admit_response(const struct mp2_admit *set, int slot,
+                                          const struct mp2_admit_node *extra,
+                                          const struct mp2_admit_node *node, uint64_t start){
+  uint64_t response = start, next;
+  int j;
+
+  for (;;) {
+    next = node->runtime;
+    for (j = 0; j < slot; j++) {
+      const struct mp2_admit_node *hp = set->tasks[j];
+      next += MP2_DIV64(response + hp->period - 1, hp->period) * hp->runtime;
+    }
+    if (extra)
+      next += MP2_DIV64(response + extra->period - 1, extra->period) * extra->runtime;
+    if (next > node->period)
+      return node->period + 1;
+    if (next == response)
+      return response;
+    response = next;
+  }
+}
+
+/**
+ * Tests whether node can join the admitted task set
+ * For MP2_ADMIT_RTA the candidate response times are left in the nodes
+ * for mp2_admit_add to commit
+ *
+ * RETURN 1 if admissible, 0 otherwise
+**/
+static inline int mp2_admit_test(struct mp2_admit *set, struct mp2_admit_node *node, int policy){
+  int slot, i;
+
+  if (set->nr >= set->capacity || !node->period || node->runtime > node->period)
+    return 0;
+
+  switch (policy) {
+    case MP2_ADMIT_HYPERBOLIC :
+      return mp2_admit_hyper_mul(set->hyperbolic, node) <= 2 * MP2_ADMIT_PPM;
+    case MP2_ADMIT_RTA :
+      slot = mp2_admit_slot(set, node);
+      node->candidate = mp2_admit_response(set, slot, NULL, node, node->runtime);
+      if (node->candidate > node->period)
+        return 0;
+      // Only lower priority tasks feel the new task
+      for (i = slot; i < set->nr; i++) {
+        struct mp2_admit_node *lp = set->tasks[i];
+        lp->candidate = mp2_admit_response(set, i, node, lp, lp->response + node->runtime);
+        if (lp->candidate > lp->period)
+          return 0;
+      }
+      return 1;
+    case MP2_ADMIT_EDF :
+      return set->utilization_ppm + mp2_admit_util_ppm(node) <= MP2_ADMIT_PPM;
+    default :
+      return set->utilization + mp2_admit_util(node) <= MP2_ADMIT_LL_BOUND;
+  }
+}
+
+/**
+ * Adds a node that passed mp2_admit_test with the same policy
+**/
+static inline void mp2_admit_add(struct mp2_admit *set, struct mp2_admit_node *node, int policy){
+  int slot = mp2_admit_slot(set, node);
+  int i;
+
+  if (policy == MP2_ADMIT_RTA) {
+    node->response = node->candidate;
+    for (i = slot; i < set->nr; i++)
+      set->tasks[i]->response = set->tasks[i]->candidate;
+  } else {
+    node->response = node->runtime;
+  }
+
+  for (i = set->nr; i > slot; i--)
+    set->tasks[i] = set->tasks[i - 1];
+  set->tasks[slot] = node;
+  set->nr++;
+  set->utilization += mp2_admit_util(node);
+  set->utilization_ppm += mp2_admit_util_ppm(node);
+  set->hyperbolic = mp2_admit_hyper_mul(set->hyperbolic, node);
+}
+
+/**
+ * Removes an admitted node
+ * Lower priority response times and the hyperbolic product are recomputed,
+ * which only runs on deregistration
+**/
+static inline void mp2_admit_remove(struct mp2_admit *set, struct mp2_admit_node *node){
+  int slot, i;
+
+  for (slot = 0; slot < set->nr && set->tasks[slot] != node; slot++)
+    ;
+  if (slot == set->nr)
+    return;
+
+  for (i = slot; i < set->nr - 1; i++)
+    set->tasks[i] = set->tasks[i + 1];
+  set->nr--;
+  set->utilization -= mp2_admit_util(node);
+  set->utilization_ppm -= mp2_admit_util_ppm(node);
+
+  set->hyperbolic = MP2_ADMIT_PPM;
+  for (i = 0; i < set->nr; i++) {
+    set->hyperbolic = mp2_admit_hyper_mul(set->hyperbolic, set->tasks[i]);
+    if (i >= slot)
+      set->tasks[i]->response = mp2_admit_response(set, i, NULL, set->tasks[i], set->tasks[i]->runtime);
+  }
+}
+
+#endif
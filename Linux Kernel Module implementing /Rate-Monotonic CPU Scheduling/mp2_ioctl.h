@@ -0,0 +1,40 @@
+#ifndef __MP2_IOCTL_INCLUDE__
+#define __MP2_IOCTL_INCLUDE__
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/**
+ * ioctl interface for /dev/mp2
+ *
+ * Every open file is one task handle. MP2_IOC_REGISTER binds the handle to a
+ * newly admitted task, MP2_IOC_YIELD and MP2_IOC_DEREGISTER act on that task
+ * without parsing or searching, and closing the handle deregisters it.
+ *
+ * /proc/mp2/status keeps accepting "R, <pid>, <period>, <runtime>",
+ * "Y, <pid>" and "D, <pid>" for tasks registered through it.
+**/
+#define MP2_DEV_NAME "mp2"
+#define MP2_IOC_MAGIC 'r'
+
+/**
+ * Registration
+ *
+ * pid user application pid, 0 for the calling task
+ * period period in microseconds
+ * runtime worst case runtime per job in microseconds
+**/
+struct mp2_ioc_register {
+  __s32 pid;
+  __u32 reserved;
+  __u64 period;
+  __u64 runtime;
+};
+
+// -ENOSPC if no CPU admits the task, -EBUSY if the handle holds one already
+#define MP2_IOC_REGISTER _IOW(MP2_IOC_MAGIC, 1, struct mp2_ioc_register)
+// -EINVAL if the handle holds no task
+#define MP2_IOC_YIELD _IO(MP2_IOC_MAGIC, 2)
+#define MP2_IOC_DEREGISTER _IO(MP2_IOC_MAGIC, 3)
+
+#endif
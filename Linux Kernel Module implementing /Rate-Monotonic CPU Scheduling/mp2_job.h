@@ -0,0 +1,128 @@
+#ifndef __MP2_JOB_INCLUDE__
+#define __MP2_JOB_INCLUDE__
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/math64.h>
+#define MP2_JOB_DIV64(a, b) div64_u64((a), (b))
+#else
+#include <stddef.h>
+#include <stdint.h>
+#define MP2_JOB_DIV64(a, b) ((a) / (b))
+#endif
+
+/**
+ * Periodic Job Accounting
+ * Release, dispatch and completion bookkeeping of one periodic task, shared
+ * by the kernel module and the userspace simulator
+ *
+ * Times are nanoseconds on one monotonic clock. Releases stay on the grid
+ * first_release + k * period however late a job runs, so they never drift.
+ * The deadline of a released job is its next release. A job that completes
+ * past its deadline skips the releases it overran, the next release is the
+ * first grid point after its completion.
+ *
+ * Nothing here allocates or locks
+**/
+
+/**
+ * Job State, embedded in the scheduled task
+ *
+ * next_period next release time, the deadline of the current job once released
+ * period period in nanoseconds
+ * release_time release time of the current job
+ * pending current job released and not yet completed
+ * started current job was put on the CPU at least once
+ * releases released jobs
+ * completions completed jobs
+ * misses jobs completed after their deadline
+ * skipped releases skipped after a miss
+ * worst_response longest release to completion time
+**/
+struct mp2_job {
+  uint64_t next_period;
+  uint64_t period;
+  uint64_t release_time;
+  int pending;
+  int started;
+  uint64_t releases;
+  uint64_t completions;
+  uint64_t misses;
+  uint64_t skipped;
+  uint64_t worst_response;
+};
+
+static inline void mp2_job_init(struct mp2_job *job, uint64_t first_release, uint64_t period){
+  job->next_period = first_release;
+  job->period = period;
+  job->release_time = 0;
+  job->pending = 0;
+  job->started = 0;
+  job->releases = 0;
+  job->completions = 0;
+  job->misses = 0;
+  job->skipped = 0;
+  job->worst_response = 0;
+}
+
+/**
+ * Releases the job due at next_period and advances next_period by one period
+**/
+static inline void mp2_job_release(struct mp2_job *job){
+  job->release_time = job->next_period;
+  job->next_period += job->period;
+  job->pending = 1;
+  job->started = 0;
+  job->releases++;
+}
+
+/**
+ * Marks the job as put on the CPU
+ *
+ * RETURN 1 on the first dispatch of a released job, 0 otherwise
+**/
+static inline int mp2_job_start(struct mp2_job *job){
+  if (!job->pending || job->started)
+    return 0;
+  job->started = 1;
+  return 1;
+}
+
+/**
+ * Completes the released job, a no-op if none is pending
+ *
+ * PARAM now completion time
+ * RETURN 1 if now is past the deadline of the job, whether pending or not
+**/
+static inline int mp2_job_complete(struct mp2_job *job, uint64_t now){
+  int missed = now > job->next_period;
+
+  if (job->pending) {
+    job->pending = 0;
+    job->completions++;
+    if (now - job->release_time > job->worst_response)
+      job->worst_response = now - job->release_time;
+    if (missed)
+      job->misses++;
+  }
+  return missed;
+}
+
+/**
+ * Moves next_period to the first grid point after now, after a miss
+ *
+ * PARAM now completion time
+ * RETURN number of releases skipped, 0 if next_period is still ahead
+**/
+static inline uint64_t mp2_job_skip(struct mp2_job *job, uint64_t now){
+  uint64_t skipped;
+
+  if (now < job->next_period)
+    return 0;
+  skipped = MP2_JOB_DIV64(now - job->next_period, job->period) + 1;
+  job->next_period += skipped * job->period;
+  job->skipped += skipped;
+  return skipped;
+}
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef __MP2_RQ_INCLUDE__
+#define __MP2_RQ_INCLUDE__
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stddef.h>
+#include <stdint.h>
+#endif
+
+/**
+ * Ready Queue
+ * Indexed binary min-heap of READY tasks keyed on their scheduling priority
+ * The smallest key is the highest priority, so picking the next task is O(1)
+ * and queueing or removing a task is O(log n)
+ *
+ * Storage is handed in by the caller, nothing here allocates or locks
+**/
+
+/**
+ * Ready Queue Node, embedded in the scheduled task
+ *
+ * key scheduling priority, smaller runs first
+ * tiebreak orders equal keys, the task pid
+ * index position in the heap, -1 when not queued
+**/
+struct mp2_rq_node {
+  uint64_t key;
+  unsigned int tiebreak;
+  int index;
+};
+
+/**
+ * Ready Queue
+ *
+ * heap node pointers, heap[0] is the highest priority
+ * size queued nodes
+ * capacity length of heap
+**/
+struct mp2_rq {
+  struct mp2_rq_node **heap;
+  int size;
+  int capacity;
+};
+
+static inline void mp2_rq_init(struct mp2_rq *rq, struct mp2_rq_node **storage, int capacity){
+  rq->heap = storage;
+  rq->size = 0;
+  rq->capacity = capacity;
+}
+
+static inline void mp2_rq_node_init(struct mp2_rq_node *node, uint64_t key, unsigned int tiebreak){
+  node->key = key;
+  node->tiebreak = tiebreak;
+  node->index = -1;
+}
+
+static inline int mp2_rq_queued(const struct mp2_rq_node *node){
+  return node->index >= 0;
+}
+
+/**
+ * RETURN 1 if a has a strictly higher priority than b
+**/
+static inline int mp2_rq_less(const struct mp2_rq_node *a, const struct mp2_rq_node *b){
+  if (a->key != b->key)
+    return a->key < b->key;
+  return a->tiebreak < b->tiebreak;
+}
+
+static inline void mp2_rq_place(struct mp2_rq *rq, struct mp2_rq_node *node, int index){
+  rq->heap[index] = node;
+  node->index = index;
+}
+
+static inline void mp2_rq_sift_up(struct mp2_rq *rq, int index){
+  struct mp2_rq_node *node = rq->heap[index];
+
+  while (index > 0) {
+    int parent = (index - 1) / 2;
+    if (!mp2_rq_less(node, rq->heap[parent]))
+      break;
+    mp2_rq_place(rq, rq->heap[parent], index);
+    index = parent;
+  }
+  mp2_rq_place(rq, node, index);
+}
+
+static inline void mp2_rq_sift_down(struct mp2_rq *rq, int index){
+  struct mp2_rq_node *node = rq->heap[index];
+
+  for (;;) {
+    int child = 2 * index + 1;
+    if (child >= rq->size)
+      break;
+    if (child + 1 < rq->size && mp2_rq_less(rq->heap[child + 1], rq->heap[child]))
+      child++;
+    if (!mp2_rq_less(rq->heap[child], node))
+      break;
+    mp2_rq_place(rq, rq->heap[child], index);
+    index = child;
+  }
+  mp2_rq_place(rq, node, index);
+}
+
+/**
+ * Queues a node that is not queued yet
+ *
+ * RETURN 0 if queued, -1 if the queue is full
+**/
+static inline int mp2_rq_push(struct mp2_rq *rq, struct mp2_rq_node *node){
+  if (rq->size >= rq->capacity)
+    return -1;
+  rq->heap[rq->size] = node;
+  node->index = rq->size++;
+  mp2_rq_sift_up(rq, node->index);
+  return 0;
+}
+
+/**
+ * RETURN highest priority node, NULL if empty
+**/
+static inline struct mp2_rq_node *mp2_rq_peek(const struct mp2_rq *rq){
+  return rq->size ? rq->heap[0] : NULL;
+}
+
+/**
+ * Dispatch decision
+ *
+ * PARAM running node of the running task, NULL if the CPU is free
+ * RETURN highest priority node if it should run instead, NULL otherwise
+**/
+static inline struct mp2_rq_node *mp2_rq_pick(const struct mp2_rq *rq, const struct mp2_rq_node *running){
+  struct mp2_rq_node *node = mp2_rq_peek(rq);
+
+  if (node == NULL || (running != NULL && !mp2_rq_less(node, running)))
+    return NULL;
+  return node;
+}
+
+/**
+ * Removes a node from anywhere in the queue, no-op if it is not queued
+**/
+static inline void mp2_rq_remove(struct mp2_rq *rq, struct mp2_rq_node *node){
+  int index = node->index;
+  struct mp2_rq_node *last;
+
+  if (index < 0)
+    return;
+  node->index = -1;
+  last = rq->heap[--rq->size];
+  if (last == node)
+    return;
+  mp2_rq_place(rq, last, index);
+  if (index > 0 && mp2_rq_less(last, rq->heap[(index - 1) / 2]))
+    mp2_rq_sift_up(rq, index);
+  else
+    mp2_rq_sift_down(rq, index);
+}
+
+#endif
@@ -0,0 +1,330 @@
+#include "mp2_rq.h"
+#include "mp2_admit.h"
+#include "mp2_job.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * MP2 Scheduler Simulator
+ * Discrete-event simulation of one mp2 CPU built on the same ready queue,
+ * admission control and job accounting the kernel module uses
+ *
+ * Every job runs for exactly its declared runtime. A job is released at its
+ * next period once the previous one completed. A job that overran skips to
+ * the first period after its completion through mp2_job_skip, the same rule
+ * the yield driven release timer of the module follows.
+ *
+ * With -o the first admitted task never yields. Each of its jobs runs until
+ * its budget, the declared runtime, runs out and is then throttled like the
+ * module's budget enforcement throttles it: it takes no more CPU and is
+ * released again at its next period, after skipping the periods already past.
+ *
+ * Usage: mp2_sim [-n tasks] [-u utilization] [-j jobs] [-p policy]
+ *                [-a admission] [-s seed] [-f] [-l] [-o] [-v]
+ *    -n number of tasks to generate (16)
+ *    -u total utilization of the generated set in per-mille (690)
+ *    -j jobs to complete or throttle before stopping (1000000)
+ *    -p 0 rate-monotonic, 1 earliest-deadline-first (0)
+ *    -a admission test as the module parameter, ignored under EDF (0)
+ *    -s random seed (time)
+ *    -f simulate every task, skipping admission control
+ *    -l dispatch with a linear scan over all tasks instead of the ready queue
+ *    -o the first admitted task overruns every job and never yields
+ *    -v print per task results
+**/
+#define SIM_MIN_PERIOD 10000
+#define SIM_MAX_PERIOD 1000000
+
+/**
+ * Simulated Task
+ *
+ * rq_node ready queue node, keyed as in the module
+ * release_node release event queue node, keyed on the release time
+ * admit_node admission control node
+ * job job accounting
+ * period period in microseconds
+ * runtime runtime in microseconds
+ * remaining time left to the current job in nanoseconds
+ * ready READY, used by the linear scan
+ * hog never yields, its jobs end by being throttled
+ * throttles jobs throttled at the end of their budget
+**/
+struct sim_task {
+	struct mp2_rq_node rq_node;
+	struct mp2_rq_node release_node;
+	struct mp2_admit_node admit_node;
+	struct mp2_job job;
+	unsigned long period;
+	unsigned long runtime;
+	uint64_t remaining;
+	int ready;
+	int hog;
+	uint64_t throttles;
+};
+
+// Simulated task a ready queue or release node is embedded in
+#define sim_task_of(node, member) ((struct sim_task *)((char *)(node) - offsetof(struct sim_task, member)))
+
+// Simulation Setup
+int nr_tasks = 16;
+unsigned long utilization = 690;
+uint64_t max_jobs = 1000000;
+int policy = 0;
+int admission = MP2_ADMIT_LIU_LAYLAND;
+int force = 0;
+int scan = 0;
+int overrun = 0;
+int verbose = 0;
+
+/**
+ * Get current time in nanoseconds
+ *
+ * RETURN current monotonic nanoseconds
+**/
+uint64_t get_nsec(){
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+/**
+ * Generates a random task set
+ * Periods are uniform in [SIM_MIN_PERIOD, SIM_MAX_PERIOD] microseconds and the
+ * total utilization is split over the tasks with random weights
+ *
+ * PARAM tasks array of nr_tasks tasks
+**/
+void generate_tasks(struct sim_task *tasks){
+	int i;
+	uint64_t total = 0;
+	uint64_t *weight = calloc(nr_tasks, sizeof(uint64_t));
+
+	for (i = 0; i < nr_tasks; i++){
+		weight[i] = 1 + rand() % 1000;
+		total += weight[i];
+	}
+	for (i = 0; i < nr_tasks; i++){
+		tasks[i].period = SIM_MIN_PERIOD + rand() % (SIM_MAX_PERIOD - SIM_MIN_PERIOD + 1);
+		// runtime = period * utilization * weight / total, in per-mille
+		tasks[i].runtime = tasks[i].period * utilization * weight[i] / total / 1000;
+		if (tasks[i].runtime == 0)
+			tasks[i].runtime = 1;
+	}
+	free(weight);
+}
+
+/**
+ * Ready Queue key under the scheduling policy, as in the module
+ *
+ * RETURN period for RM, absolute deadline in nanoseconds for EDF
+**/
+uint64_t task_priority(struct sim_task *task){
+	if (policy == 1)
+		return task->job.next_period;
+	return task->period;
+}
+
+/**
+ * Linear scan dispatcher, the pre ready queue mp2 dispatcher
+ *
+ * PARAM tasks simulated tasks
+ * PARAM nr number of simulated tasks
+ * PARAM running running task, NULL if the CPU is free
+ * RETURN highest priority READY task if it should run instead, NULL otherwise
+**/
+struct sim_task *pick_scan(struct sim_task **tasks, int nr, struct sim_task *running){
+	int i;
+	struct sim_task *best = NULL;
+
+	for (i = 0; i < nr; i++){
+		if (tasks[i]->ready && (best == NULL || mp2_rq_less(&tasks[i]->rq_node, &best->rq_node)))
+			best = tasks[i];
+	}
+	if (best == NULL || (running != NULL && !mp2_rq_less(&best->rq_node, &running->rq_node)))
+		return NULL;
+	return best;
+}
+
+/**
+ * Parses command line options into the simulation setup
+ *
+ * RETURN 0 if successful, -1 if error
+**/
+int parse_args(int argc, char **argv){
+	int opt;
+	unsigned int seed = time(NULL);
+
+	while ((opt = getopt(argc, argv, "n:u:j:p:a:s:flov")) != -1){
+		switch (opt){
+			case 'n': nr_tasks = atoi(optarg); break;
+			case 'u': utilization = strtoul(optarg, NULL, 10); break;
+			case 'j': max_jobs = strtoull(optarg, NULL, 10); break;
+			case 'p': policy = atoi(optarg); break;
+			case 'a': admission = atoi(optarg); break;
+			case 's': seed = strtoul(optarg, NULL, 10); break;
+			case 'f': force = 1; break;
+			case 'l': scan = 1; break;
+			case 'o': overrun = 1; break;
+			case 'v': verbose = 1; break;
+			default: return -1;
+		}
+	}
+	if (nr_tasks <= 0)
+		return -1;
+	if (policy == 1)
+		admission = MP2_ADMIT_EDF;
+	printf("Seed: %u\n", seed);
+	srand(seed);
+	return 0;
+}
+
+int main(int argc, char **argv){
+	// Variable Setup
+	int i, nr = 0;
+	struct sim_task *tasks, **admitted, *running = NULL, *pick, *task;
+	struct mp2_rq ready_queue, releases;
+	struct mp2_rq_node **ready_storage, **release_storage, *event;
+	struct mp2_admit admit_set;
+	struct mp2_admit_node **admit_storage;
+	uint64_t now = 0, busy = 0, next_release, next_done, t0;
+	uint64_t completed = 0, throttled = 0, misses = 0, decisions = 0, preemptions = 0, dispatch_ns = 0;
+
+	if (parse_args(argc, argv)){
+		printf("Usage: %s [-n tasks] [-u utilization] [-j jobs] [-p policy] [-a admission] [-s seed] [-f] [-l] [-o] [-v]\n", argv[0]);
+		return 1;
+	}
+
+	tasks = calloc(nr_tasks, sizeof(struct sim_task));
+	admitted = calloc(nr_tasks, sizeof(struct sim_task *));
+	ready_storage = calloc(nr_tasks, sizeof(struct mp2_rq_node *));
+	release_storage = calloc(nr_tasks, sizeof(struct mp2_rq_node *));
+	admit_storage = calloc(nr_tasks, sizeof(struct mp2_admit_node *));
+	if (!tasks || !admitted || !ready_storage || !release_storage || !admit_storage){
+		printf("Out of memory\n");
+		return 1;
+	}
+	mp2_rq_init(&ready_queue, ready_storage, nr_tasks);
+	mp2_rq_init(&releases, release_storage, nr_tasks);
+	mp2_admit_init(&admit_set, admit_storage, nr_tasks);
+
+	// Admit the generated tasks in order, as if they registered one by one
+	generate_tasks(tasks);
+	for (i = 0; i < nr_tasks; i++){
+		task = &tasks[i];
+		mp2_admit_node_init(&task->admit_node, task->period, task->runtime, i);
+		if (!force && !mp2_admit_test(&admit_set, &task->admit_node, admission))
+			continue;
+		if (!force)
+			mp2_admit_add(&admit_set, &task->admit_node, admission);
+
+		// Every task is released at 0, the critical instant
+		mp2_job_init(&task->job, 0, task->period * 1000ULL);
+		mp2_rq_node_init(&task->rq_node, task->period, i);
+		mp2_rq_node_init(&task->release_node, 0, i);
+		mp2_rq_push(&releases, &task->release_node);
+		admitted[nr++] = task;
+	}
+	printf("Tasks: %d, Admitted: %d, Policy: %s, Dispatcher: %s\n", nr_tasks, nr,
+	       policy == 1 ? "EDF" : "RM", scan ? "linear scan" : "ready queue");
+	if (nr == 0)
+		return 0;
+	admitted[0]->hog = overrun;
+
+	// Event Loop
+	while (completed + throttled < max_jobs){
+		event = mp2_rq_peek(&releases);
+		next_release = event ? event->key : UINT64_MAX;
+		next_done = running ? now + running->remaining : UINT64_MAX;
+
+		if (next_done <= next_release){
+			busy += running->remaining;
+			now = next_done;
+			running->remaining = 0;
+			if (running->hog){
+				// Budget ran out, the job is throttled until its next period
+				mp2_job_skip(&running->job, now);
+				running->throttles++;
+				throttled++;
+			} else {
+				// Running job completes and yields until its next period
+				if (mp2_job_complete(&running->job, now)){
+					misses++;
+					mp2_job_skip(&running->job, now);
+				}
+				completed++;
+			}
+			running->release_node.key = running->job.next_period;
+			mp2_rq_push(&releases, &running->release_node);
+			running = NULL;
+		} else {
+			// Release every job due now
+			if (running){
+				running->remaining -= next_release - now;
+				busy += next_release - now;
+			}
+			now = next_release;
+			while ((event = mp2_rq_peek(&releases)) && event->key == now){
+				task = sim_task_of(event, release_node);
+				mp2_rq_remove(&releases, event);
+				mp2_job_release(&task->job);
+				task->remaining = task->runtime * 1000ULL;
+				task->rq_node.key = task_priority(task);
+				task->ready = 1;
+				if (!scan)
+					mp2_rq_push(&ready_queue, &task->rq_node);
+			}
+		}
+
+		// Dispatch Decision
+		t0 = get_nsec();
+		if (scan){
+			pick = pick_scan(admitted, nr, running);
+		} else {
+			event = mp2_rq_pick(&ready_queue, running ? &running->rq_node : NULL);
+			pick = event ? sim_task_of(event, rq_node) : NULL;
+		}
+		if (pick){
+			if (running){
+				running->ready = 1;
+				if (!scan)
+					mp2_rq_push(&ready_queue, &running->rq_node);
+				preemptions++;
+			}
+			pick->ready = 0;
+			if (!scan)
+				mp2_rq_remove(&ready_queue, &pick->rq_node);
+			mp2_job_start(&pick->job);
+			running = pick;
+		}
+		dispatch_ns += get_nsec() - t0;
+		decisions++;
+	}
+
+	// Results
+	printf("Jobs: %llu, Simulated: %llu ns, Utilization: %llu/1000\n",
+	       (unsigned long long)completed, (unsigned long long)now,
+	       (unsigned long long)(now ? busy * 1000 / now : 0));
+	printf("Decisions: %llu, Dispatch: %llu ns/decision, Preemptions: %llu\n",
+	       (unsigned long long)decisions, (unsigned long long)(dispatch_ns / decisions),
+	       (unsigned long long)preemptions);
+	printf("Deadline Misses: %llu, Throttled: %llu\n", (unsigned long long)misses, (unsigned long long)throttled);
+	if (verbose){
+		for (i = 0; i < nr; i++){
+			task = admitted[i];
+			printf("%d: %lu, %lu, %llu, %llu, %llu, %llu, %llu, %llu\n", (int)(task - tasks), task->period, task->runtime,
+			       (unsigned long long)task->job.releases, (unsigned long long)task->job.completions,
+			       (unsigned long long)task->job.misses, (unsigned long long)task->job.worst_response,
+			       (unsigned long long)task->job.skipped, (unsigned long long)task->throttles);
+		}
+	}
+
+	free(tasks);
+	free(admitted);
+	free(ready_storage);
+	free(release_storage);
+	free(admit_storage);
+	return 0;
+}
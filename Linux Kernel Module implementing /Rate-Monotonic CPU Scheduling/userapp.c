@@ -1,10 +1,16 @@
 #include "userapp.h"
+#include "mp2_ioctl.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/time.h>
 #include <time.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+// /dev/mp2 task handle, -1 when talking to /proc/mp2/status
+int mp2_fd = -1;
 
 /**
  * Factorial Function
@@ -54,6 +60,46 @@ int proc_fs(char message, int PID, unsigned long Period, unsigned long JobProces
 	}
 }
 
+/**
+ * Device Function
+ * Sends messages to the Kernel Module through /dev/mp2 (Yield, Register, De-register)
+ * Yield is a single ioctl on the handle opened at registration
+ * Falls back to proc_fs when /dev/mp2 is not available
+ *
+ * PARAM PID user application pid
+ * PARAM Period user application period
+ * PARAM JobProcessTime runtime of one real time loop
+ * RETURN 0 if successful, -1 if error
+**/
+int dev_fs(char message, int PID, unsigned long Period, unsigned long JobProcessTime){
+	struct mp2_ioc_register reg;
+
+	if (message == 'R' && mp2_fd < 0){
+		mp2_fd = open("/dev/mp2", O_RDWR | O_CLOEXEC);
+	}
+	if (mp2_fd < 0){
+		return proc_fs(message, PID, Period, JobProcessTime);
+	}
+
+	if (message == 'Y'){
+		// Yield Function, Notifies Kernel Module that User App is done
+		return ioctl(mp2_fd, MP2_IOC_YIELD) ? -1 : 0;
+	} else if (message == 'R') {
+		// Register Function, Registers app with Kernel Module
+		reg.pid = PID;
+		reg.reserved = 0;
+		reg.period = Period;
+		reg.runtime = JobProcessTime;
+		return ioctl(mp2_fd, MP2_IOC_REGISTER, &reg) ? -1 : 0;
+	} else if (message == 'D') {
+		// De-Register Function, De-Registers app from Kernel Module
+		ioctl(mp2_fd, MP2_IOC_DEREGISTER);
+		close(mp2_fd);
+		mp2_fd = -1;
+	}
+	return 0;
+}
+
 /**
  * Checks /proc/mp2/status to ensure Process is registered
  *
@@ -146,7 +192,7 @@ void main(void){
 	printf("PID: %d\n", PID);
 	printf("Utilization: %lu\n", JobProcessTime * 1000 / Period);
 	// Register Process to Scheduler
-	if (proc_fs('R', PID, Period, JobProcessTime) == -1) {
+	if (dev_fs('R', PID, Period, JobProcessTime) == -1) {
 		printf("Error Registering Process\n");
 		return;
 	}
@@ -166,7 +212,7 @@ void main(void){
         printf("FIRST YIELD\n");
 
 	// Initial Yield Query
-	proc_fs('Y', PID, -1, -1);
+	dev_fs('Y', PID, -1, -1);
 
 	printf("STARTING REAL-TIME LOOP\n");
 
@@ -184,12 +230,12 @@ void main(void){
 		//printf("Computation Time: %lu\n", JobProcessTime);
 
 		// Yield
-		proc_fs('Y', PID, -1, -1);
+		dev_fs('Y', PID, -1, -1);
 		
 		// Decrement Remaining Jobs
 		jobs = jobs - 1;
 	}
 
 	// De-Register Process
-	proc_fs('D', PID, -1, -1);
+	dev_fs('D', PID, -1, -1);
 }
@@ -1,5 +1,5 @@
 rmmod mp3
 rm node
 insmod mp3.ko
-mknod node c 150 0
+mknod node c $(awk '$2 == "mp3" {print $1}' /proc/devices) 0
 lsmod
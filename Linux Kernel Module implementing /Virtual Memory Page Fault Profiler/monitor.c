@@ -8,32 +8,63 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include "mp3_ring.h"
 
-#define NPAGES (128)   // The size of profiler buffer (Unit: memory page)
-#define BUFD_MAX 48000 // The max number of profiled samples stored in the profiler buffer
+#define STREAM_RECORDS 256
 
 static int buf_fd = -1;
 static int buf_len;
 
-// This function opens a character device (which is pointed by a file named as fname) and performs the mmap() operation. If the operations are successful, the base address of memory mapped buffer is returned. Otherwise, a NULL pointer is returned.
-void *buf_init(char *fname)
+// Profile state carried from one record to the next, across reads when streaming
+static unsigned long long sample_time = 0, min_flt = 0, maj_flt = 0, cpu = 0;
+static int ticks = 0, samples = 0;
+
+// Mapping kinds of VMA records, indexed by MP3_VMA_*
+static const char *vma_kinds[] = { "anon", "heap", "stack", "file", "shared" };
+
+// This function opens a character device (which is pointed by a file named as fname) with the given flags, maps its header page read-only and checks the ring layout matches this build. If the operations are successful, the base address of the header page is returned. Otherwise, a NULL pointer is returned.
+struct mp3_ring_header *buf_header(char *fname, int flags)
 {
-  unsigned int *kadr;
+  struct mp3_ring_header *ring;
 
   if(buf_fd == -1){
-    buf_len = NPAGES * getpagesize();
-    if ((buf_fd=open(fname, O_RDWR|O_SYNC))<0){
+    if ((buf_fd=open(fname, flags))<0){
         printf("file open error. %s\n", fname);
         return NULL;
     }
   }
-  kadr = mmap(0, buf_len, PROT_READ|PROT_WRITE, MAP_SHARED, buf_fd, 0);
-  if (kadr == MAP_FAILED){
+  ring = mmap(0, getpagesize(), PROT_READ, MAP_SHARED, buf_fd, 0);
+  if (ring == MAP_FAILED){
+      printf("buf file open error.\n");
+      return NULL;
+  }
+  if (ring->magic != MP3_RING_MAGIC || ring->version != MP3_RING_VERSION || ring->record_size != sizeof(struct mp3_record)){
+      printf("buf file version mismatch.\n");
+      munmap(ring, getpagesize());
+      return NULL;
+  }
+  return ring;
+}
+
+// This function opens a character device (which is pointed by a file named as fname) and performs the read-only mmap() operation. The ring header is mapped first to learn the ring size, then the whole ring is mapped. If the operations are successful, the base address of the ring header is returned. Otherwise, a NULL pointer is returned.
+struct mp3_ring_header *buf_init(char *fname)
+{
+  struct mp3_ring_header *ring;
+
+  ring = buf_header(fname, O_RDONLY);
+  if (!ring)
+    return NULL;
+  buf_len = ring->data_offset + ring->nr_records * ring->record_size;
+  munmap(ring, getpagesize());
+
+  ring = mmap(0, buf_len, PROT_READ, MAP_SHARED, buf_fd, 0);
+  if (ring == MAP_FAILED){
       printf("buf file open error.\n");
       return NULL;
   }
 
-  return kadr;
+  return ring;
 }
 
 // This function closes the opened character device file.
@@ -45,51 +76,130 @@ void buf_exit()
   }
 }
 
+// This function prints one sampling pass summed over every profiled process, the pre per-process profile format.
+void print_total(unsigned long long time, unsigned long long min_flt, unsigned long long maj_flt, unsigned long long cpu)
+{
+  printf("%llu %llu %llu %llu\n", time, min_flt, maj_flt, cpu);
+}
+
+// This function prints one record, or with total set adds it to the pass it belongs to and prints the previous pass when a new one starts.
+void print_record(struct mp3_record *record, int total)
+{
+  if(record->type == MP3_REC_TICK){
+    if(total && ticks)
+      print_total(sample_time, min_flt, maj_flt, cpu);
+    sample_time = record->u.tick.time;
+    min_flt = maj_flt = cpu = 0;
+    ticks++;
+  } else if(record->type == MP3_REC_PID){
+    if(total){
+      min_flt += record->u.delta.min_flt;
+      maj_flt += record->u.delta.maj_flt;
+      cpu += record->u.delta.utime + record->u.delta.stime;
+    } else {
+      printf("%llu %d %u %u %u %u\n", sample_time, record->pid, record->u.delta.min_flt, record->u.delta.maj_flt,
+             record->u.delta.utime, record->u.delta.stime);
+    }
+    samples++;
+  } else if(record->type == MP3_REC_WSS && !total){
+    printf("%llu %d wss %u %u %llu\n", sample_time, record->pid, record->u.wss.wss, record->u.wss.rss,
+           (unsigned long long)record->u.wss.window);
+  } else if(record->type == MP3_REC_LOST){
+    fprintf(stderr, "%llu records lost, %llu since open\n", (unsigned long long)record->u.lost.records,
+            (unsigned long long)record->u.lost.dropped);
+  } else if(record->type == MP3_REC_VMA && !total){
+    printf("%llu %d vma %s %llx %u %u\n", sample_time, record->pid,
+           record->count <= MP3_VMA_SHARED ? vma_kinds[record->count] : "unknown",
+           (unsigned long long)record->u.vma.start, record->u.vma.min_flt, record->u.vma.maj_flt);
+  }
+}
+
+// This function follows the ring with blocking reads of the char device until it is interrupted, the module wakes it once enough records are waiting so it sleeps while idle.
+int follow(int total)
+{
+  struct mp3_ring_header *ring;
+  struct mp3_record records[STREAM_RECORDS];
+  unsigned long long dropped;
+  ssize_t len;
+  int i;
+
+  ring = buf_header("node", O_RDONLY);
+  if(!ring)
+    return -1;
+  dropped = ring->dropped;
+
+  while((len = read(buf_fd, records, sizeof(records))) > 0){
+    for(i = 0; i < len / (ssize_t)sizeof(struct mp3_record); i++)
+      print_record(&records[i], total);
+    fflush(stdout);
+    if(ring->dropped != dropped){
+      fprintf(stderr, "%llu records dropped, no room in the ring\n", (unsigned long long)(ring->dropped - dropped));
+      dropped = ring->dropped;
+    }
+  }
+  if(len < 0)
+    perror("read");
+
+  munmap(ring, getpagesize());
+  buf_exit();
+  return len < 0 ? -1 : 0;
+}
+
+// Usage: monitor [-a] [-f]
+// Prints "<time> <pid> <min_flt> <maj_flt> <utime> <stime>" per profiled process and sampling pass, "<time> <pid> wss <wss_pages> <rss_pages> <window_ns>" per completed working set sweep and "<time> <pid> vma <kind> <start> <min_flt> <maj_flt>" per faulting mapping, or with -a one "<time> <min_flt> <maj_flt> <cpu>" line per pass summed over every process. With -f it keeps following the ring through read() instead of printing what the ring holds and exiting. The ring is shared read-only, so any number of monitors can run at once.
 int main(int argc, char* argv[])
 {
-  long *buf;
-  int index = 0;
+  struct mp3_ring_header *ring;
+  struct mp3_record *records, record;
+  unsigned long long seq, head, lost = 0;
+  int total = 0, stream = 0, synced = 0;
   int i;
 
+  for(i = 1; i < argc; i++){
+    if(strcmp(argv[i], "-a") == 0)
+      total = 1;
+    else if(strcmp(argv[i], "-f") == 0)
+      stream = 1;
+    else {
+      printf("Usage: %s [-a] [-f]\n", argv[0]);
+      return -1;
+    }
+  }
+  if(stream)
+    return follow(total);
+
   // Open the char device and mmap()
-  buf = buf_init("node");
-  if(!buf)
+  ring = buf_init("node");
+  if(!ring)
     return -1;
-  
-  //printf("BEFORE READ/PRINT\n");
-
-  // Read and print profiled data
-  for(index=0; index<BUFD_MAX; index++)
-    if(buf[index] != -1) break;
-
-  //printf("BEFORE WHILE: broke at %d\n",index);
-
-  i = 0;
-  while(buf[index] != -1){
-    printf("%ld ", buf[index]);
-    buf[index++] = -1;
-    if(index >= BUFD_MAX)
-      index = 0;
-
-    printf("%ld ", buf[index]);
-    buf[index++] = -1;
-    if(index >= BUFD_MAX)
-      index = 0;
-
-    printf("%ld ", buf[index]);
-    buf[index++] = -1;
-    if(index >= BUFD_MAX)
-      index = 0;
-
-    printf("%ld\n", buf[index]);
-    buf[index++] = -1;
-    if(index >= BUFD_MAX)
-      index = 0;
-    i++;
+  records = (struct mp3_record *)((char *)ring + ring->data_offset);
+
+  // Read and print profiled data, every record the module still holds. A
+  // record is only used once tail shows the module did not overwrite it
+  // while it was copied, and a pass is only used from its TICK on.
+  head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  for(seq = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE); seq < head; seq++){
+    record = records[seq % ring->nr_records];
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&ring->tail, __ATOMIC_RELAXED) > seq || (!synced && record.type != MP3_REC_TICK)){
+      synced = 0;
+      lost++;
+      continue;
+    }
+    synced = 1;
+    print_record(&record, total);
   }
-  printf("read %d profiled data\n", i);
+  if(total && ticks)
+    print_total(sample_time, min_flt, maj_flt, cpu);
+
+  printf("read %d profiled data in %d samples\n", samples, ticks);
+  if(lost)
+    fprintf(stderr, "%llu records overwritten while reading\n", lost);
+  if(ring->dropped)
+    fprintf(stderr, "%llu records dropped, no room in the ring\n", (unsigned long long)ring->dropped);
 
   // Close the char device
+  munmap(ring, buf_len);
   buf_exit();
+  return 0;
 }
-
@@ -12,6 +12,7 @@
 #include <linux/proc_fs.h>
 // Filesystem I/O
 #include <linux/fs.h>
+#include <linux/seq_file.h>
 #include <linux/file.h> 
 #include <linux/buffer_head.h>
 #include <asm/segment.h>
@@ -29,13 +30,34 @@
 // Timer Libraries
 #include <linux/timer.h>
 #include <linux/jiffies.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
 // Type Libraries
 #include <linux/types.h>
 // String
 #include <linux/string.h>
+// Module Parameters
+#include <linux/moduleparam.h>
+#include <linux/math64.h>
+// Working Set Scan
+#include <linux/mm.h>
+#include <linux/huge_mm.h>
+#include <linux/page_idle.h>
+// Fault Attribution
+#include <linux/kprobes.h>
+#include <linux/percpu.h>
+#include <linux/hash.h>
+#include <linux/shmem_fs.h>
+#include <linux/rcupdate.h>
+// Blocking Reads
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/mutex.h>
 
 // Given Functions
 #include "mp3_given.h"
+// Profiling Ring
+#include "mp3_ring.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Group_ID");
@@ -45,9 +67,8 @@ MODULE_DESCRIPTION("CS-423 MP3");
 #define DEBUG 1
 #define FILENAME "status"
 #define DIRECTORY "mp3"
+#define DEVICE_NAME "mp3"
 #define BUFSIZE 128
-#define SHAREDBUFSIZE (1024*512)
-#define LONGSIZE (sizeof(long))
 #define PAGESIZE 4096
 
 /**
@@ -60,6 +81,15 @@ MODULE_DESCRIPTION("CS-423 MP3");
  * process_usage process utilization
  * maj_flt major fault count
  * min_flt minor fault count
+ * utime, stime cpu time, like the fault counts taken at the last sample
+ * prev_* absolute task counters at the previous sample, deltas are taken
+ *    against them so the task itself is never written
+ * wss_cursor address the working set sweep resumes from
+ * wss_young accessed pages seen so far in the current sweep
+ * wss_start time the current sweep started
+ * wss_sweeps completed sweeps
+ * wss_ready a completed sweep waits to be recorded
+ * wss_size, rss_size, wss_window result of the last completed sweep
 **/
 typedef struct mp_task_struct {
   struct list_head list;
@@ -69,17 +99,147 @@ typedef struct mp_task_struct {
   unsigned long process_usage;
   unsigned long maj_flt;
   unsigned long min_flt; 
+  unsigned long utime;
+  unsigned long stime;
+
+  unsigned long prev_min_flt;
+  unsigned long prev_maj_flt;
+  unsigned long prev_utime;
+  unsigned long prev_stime;
+
+  unsigned long wss_cursor;
+  unsigned long wss_young;
+  u64 wss_start;
+  unsigned int wss_sweeps;
+  int wss_ready;
+  unsigned long wss_size;
+  unsigned long rss_size;
+  u64 wss_window;
 } mp_struct;
 
-//Time Interval Manager
-static unsigned long last_time = 0;
+//Time Interval Manager, CLOCK_MONOTONIC nanoseconds of the last pass
+static u64 last_time = 0;
+
+// Adaptive Sampling, the interval halves after a pass that saw faults and
+// doubles after a pass with all zero deltas, within [min, max]
+static unsigned int min_interval_us = 1000;
+module_param(min_interval_us, uint, 0644);
+MODULE_PARM_DESC(min_interval_us, "Shortest sampling interval in microseconds (default 1000)");
+static unsigned int max_interval_us = 1000000;
+module_param(max_interval_us, uint, 0644);
+MODULE_PARM_DESC(max_interval_us, "Longest sampling interval in microseconds (default 1000000)");
+static u64 sample_interval = 50 * NSEC_PER_MSEC;
+static struct hrtimer sample_timer;
+static struct work_struct sample_work;
+static bool sampling = true;
+
+// Working Set Estimation, pages of address space each pass scans per process
+static unsigned int wss_scan_pages = 0;
+module_param(wss_scan_pages, uint, 0644);
+#ifdef CONFIG_IDLE_PAGE_TRACKING
+MODULE_PARM_DESC(wss_scan_pages, "Pages scanned per process and sampling pass for working set records, 0 disables (default 0)");
+#else
+MODULE_PARM_DESC(wss_scan_pages, "Pages scanned per process and sampling pass for working set records, 0 disables (default 0). "
+                 "Without CONFIG_IDLE_PAGE_TRACKING the scan hides accesses from reclaim, which may evict the scanned pages");
+#endif
+
+// Fault Attribution, faults of registered processes counted per mapping
+static bool vma_faults = false;
+module_param(vma_faults, bool, 0444);
+MODULE_PARM_DESC(vma_faults, "Attribute faults to mappings and record them every pass (default off)");
+static unsigned int vma_fault_shift = 0;
+module_param(vma_fault_shift, uint, 0644);
+MODULE_PARM_DESC(vma_fault_shift, "Attribute faults to 2^shift byte address buckets instead of whole VMAs, 0 for VMAs (default 0)");
+
+#define FAULT_BITS 7
+#define FAULT_SLOTS (1 << FAULT_BITS)
 
-//Character Device Data Struct
+/**
+ * Fault Table Entry, one mapping or bucket of a registered process
+ *
+ * pid registered process, 0 for a free slot
+ * kind MP3_VMA_* kind of the mapping faulted on
+ * key start of the VMA or of the address bucket
+ * min_flt minor faults since the last pass
+ * maj_flt major faults since the last pass
+**/
+struct fault_entry {
+  int pid;
+  u16 kind;
+  unsigned long key;
+  u32 min_flt;
+  u32 maj_flt;
+};
+
+/**
+ * Per-CPU Fault Table, open addressed on (pid, key, kind)
+ *
+ * lock taken by the fault probe on its own CPU and by the drain
+ * nr used slots
+ * lost faults that found the table full
+**/
+struct fault_table {
+  spinlock_t lock;
+  unsigned int nr;
+  unsigned long lost;
+  struct fault_entry slots[FAULT_SLOTS];
+};
+
+/**
+ * Registered pids the fault probe looks for, replaced under RCU
+**/
+struct fault_pids {
+  struct rcu_head rcu;
+  int nr;
+  int pids[];
+};
+
+/**
+ * Fault in flight, carried from the probe entry to its return
+**/
+struct fault_probe {
+  int pid;
+  u16 kind;
+  unsigned long key;
+};
+
+static struct fault_table __percpu *fault_tables;
+static struct fault_pids __rcu *fault_pids;
+
+//Character Device Data Struct, numbers allocated at load
 struct cdev cdevdata;
+static dev_t cdev_number;
+
+// Virtual Buffer, the ring header page followed by ring_pages pages of records
+static unsigned int ring_pages = 128;
+module_param(ring_pages, uint, 0444);
+MODULE_PARM_DESC(ring_pages, "Profiling ring size in pages, header page excluded (default 128)");
+static void * shared_buffer;
+static unsigned long shared_size;
+static struct mp3_ring_header * ring;
+static struct mp3_record * ring_records;
+
+// Blocking Readers, woken once wakeup records are waiting
+static unsigned int wakeup = 64;
+module_param(wakeup, uint, 0644);
+MODULE_PARM_DESC(wakeup, "Records waiting before blocked readers and pollers wake (default 64)");
+static DECLARE_WAIT_QUEUE_HEAD(ring_wait);
+static u64 wake_head = 0;
 
-// Virtual Buffer
-static long* shared_buffer;
-static int shared_index = 0;
+/**
+ * Per-Open Reader, the private data of every open file of the device
+ *
+ * lock serializes reads of the same file
+ * cursor sequence of the next record the file reads
+ * dropped records overwritten before the file read them
+ * lost dropped records not reported to the file yet
+**/
+struct mp3_reader {
+  struct mutex lock;
+  u64 cursor;
+  u64 dropped;
+  u64 lost;
+};
 
 // ProcFS Structs
 static struct proc_dir_entry *proc_dir;
@@ -98,14 +258,12 @@ static spinlock_t lock;
 static struct workqueue_struct *queue;
 
 /**
- * Get Current Time in jiffies
+ * Get Current Time
  *
- * RETURN current time in jiffies
+ * RETURN current CLOCK_MONOTONIC time in nanoseconds
 **/
-static unsigned long _get_time(void){
-   struct timeval time;
-   do_gettimeofday(&time);
-   return usecs_to_jiffies(time.tv_sec * 1000000L + time.tv_usec);
+static u64 _get_time(void){
+   return ktime_get_ns();
 }
 
 /**
@@ -130,37 +288,688 @@ static void _del_work_queue(void){
 }
 
 // Bypass Circular Declaration
-static void _reg_work(int from_bottom_half);
+static void _reg_work(void);
+
+/**
+ * Profiling ring slot of a sequence number
+ *
+ * RETURN record stored at seq % nr_records
+**/
+static struct mp3_record * ring_slot(u64 seq){
+  u32 index;
+
+  div_u64_rem(seq, ring->nr_records, &index);
+  return &ring_records[index];
+}
+
+/**
+ * Claims the slot of a sequence number for writing, lock held
+ * The record the slot held is retired from tail before it is overwritten,
+ * so a reader that sees the new record also sees it retired
+ *
+ * RETURN record stored at seq % nr_records
+**/
+static struct mp3_record * ring_claim(u64 seq){
+  if (seq >= ring->nr_records && seq - ring->nr_records + 1 > ring->tail) {
+    WRITE_ONCE(ring->tail, seq - ring->nr_records + 1);
+    smp_wmb();
+  }
+  return ring_slot(seq);
+}
+
+/**
+ * RETURN wakeup clamped to what the ring holds
+**/
+static u64 ring_threshold(void){
+  return clamp_t(u64, READ_ONCE(wakeup), 1, ring->nr_records);
+}
+
+/**
+ * Moves a reader the module overtook to the oldest retained pass, records
+ * skipped on the way count as dropped for that reader alone
+ * A pass is never read without its TICK, so the partly overwritten pass at
+ * tail is skipped as well.
+**/
+static void reader_sync(struct mp3_reader *reader){
+  u64 head = smp_load_acquire(&ring->head);
+  u64 tail = smp_load_acquire(&ring->tail);
+  u64 cursor = reader->cursor;
+
+  if (tail > head)
+    tail = head;
+  if (cursor >= tail)
+    return;
+  cursor = tail;
+  while (cursor < head && READ_ONCE(ring_slot(cursor)->type) != MP3_REC_TICK)
+    cursor++;
+  reader->dropped += cursor - reader->cursor;
+  reader->lost += cursor - reader->cursor;
+  WRITE_ONCE(reader->cursor, cursor);
+}
+
+/**
+ * RETURN 1 if the reader has wakeup records waiting or drops to report
+**/
+static int reader_ready(struct mp3_reader *reader){
+  u64 head = smp_load_acquire(&ring->head);
+  u64 cursor = READ_ONCE(reader->cursor);
+
+  if (READ_ONCE(reader->lost) || cursor < READ_ONCE(ring->tail))
+    return 1;
+  return cursor < head && head - cursor >= ring_threshold();
+}
+
+/**
+ * Saturates a counter delta to a 32 bit record field
+**/
+static u32 ring_delta(unsigned long value){
+  return value > U32_MAX ? U32_MAX : value;
+}
+
+/**
+ * Counter delta, a counter that went backwards counts from zero
+**/
+static unsigned long counter_delta(unsigned long now, unsigned long prev){
+  return now >= prev ? now - prev : now;
+}
+
+/**
+ * Reads the absolute fault and cpu counters of a process without modifying
+ * them, unlike get_cpu_use
+ *
+ * RETURN 0 if the pid is valid, -1 otherwise
+**/
+static int read_cpu_use(int pid, unsigned long *min_flt, unsigned long *maj_flt,
+                        unsigned long *utime, unsigned long *stime){
+  int ret = -1;
+  struct task_struct* task;
+
+  rcu_read_lock();
+  task = pid_task(find_vpid(pid), PIDTYPE_PID);
+  if (task != NULL) {
+    *min_flt = READ_ONCE(task->min_flt);
+    *maj_flt = READ_ONCE(task->maj_flt);
+    *utime = READ_ONCE(task->utime);
+    *stime = READ_ONCE(task->stime);
+    ret = 0;
+  }
+  rcu_read_unlock();
+  return ret;
+}
+
+/**
+ * Samples a process, returns its counts since the previous sample and keeps
+ * the absolute values for the next one
+ *
+ * RETURN 0 if the pid is valid, -1 otherwise
+**/
+static int sample_cpu_use(mp_struct * task, unsigned long *min_flt, unsigned long *maj_flt,
+                          unsigned long *utime, unsigned long *stime){
+  unsigned long abs_min_flt, abs_maj_flt, abs_utime, abs_stime;
+
+  if (read_cpu_use(task->pid, &abs_min_flt, &abs_maj_flt, &abs_utime, &abs_stime))
+    return -1;
+
+  *min_flt = counter_delta(abs_min_flt, task->prev_min_flt);
+  *maj_flt = counter_delta(abs_maj_flt, task->prev_maj_flt);
+  *utime = counter_delta(abs_utime, task->prev_utime);
+  *stime = counter_delta(abs_stime, task->prev_stime);
+  task->prev_min_flt = abs_min_flt;
+  task->prev_maj_flt = abs_maj_flt;
+  task->prev_utime = abs_utime;
+  task->prev_stime = abs_stime;
+  return 0;
+}
+
+/**
+ * Working Set Walk State
+ *
+ * budget pages to scan before stopping
+ * scanned pages scanned so far
+ * young accessed pages found, their accessed bits are cleared
+ * next address the walk stopped at once the budget ran out
+**/
+struct wss_walk {
+  unsigned long budget;
+  unsigned long scanned;
+  unsigned long young;
+  unsigned long next;
+};
+
+/**
+ * Working Set Scan of one registered process, filled without the lock
+ *
+ * pid process to scan
+ * cursor address to resume from, then the next one
+ * young accessed pages found
+ * rss resident pages
+ * done the scan reached the end of the address space
+ * valid the process had an address space to scan
+**/
+struct wss_scan {
+  int pid;
+  unsigned long cursor;
+  unsigned long young;
+  unsigned long rss;
+  int done;
+  int valid;
+};
+
+/**
+ * Hands an accessed bit the scan cleared to reclaim, which honors the page
+ * young flag as a reference, so the scan does not make the page look cold
+**/
+static void wss_keep_young(struct page *page){
+#ifdef CONFIG_IDLE_PAGE_TRACKING
+  if (page != NULL)
+    set_page_young(page);
+#endif
+}
+
+/**
+ * Page Walk PMD callback
+ * Tests and clears the accessed bit of every present page under the pmd,
+ * a transparent huge page counts as all of its small pages
+ *
+ * RETURN 1 once the budget is spent, which stops the walk
+**/
+static int wss_pmd_entry(pmd_t *pmd, unsigned long addr, unsigned long end, struct mm_walk *walk){
+  struct wss_walk *ws = walk->private;
+  struct vm_area_struct *vma = walk->vma;
+  unsigned long first = addr;
+  spinlock_t *ptl;
+  pte_t *pte, *start;
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+  ptl = pmd_trans_huge_lock(pmd, vma);
+  if (ptl) {
+    if (pmdp_test_and_clear_young(vma, addr, pmd)) {
+      ws->young += HPAGE_PMD_NR;
+      wss_keep_young(pmd_page(*pmd));
+    }
+    spin_unlock(ptl);
+    goto out;
+  }
+#endif
+  if (pmd_trans_unstable(pmd))
+    goto out;
+
+  start = pte = pte_offset_map_lock(vma->vm_mm, pmd, addr, &ptl);
+  for (; addr != end; pte++, addr += PAGE_SIZE) {
+    if (pte_present(*pte) && ptep_test_and_clear_young(vma, addr, pte)) {
+      ws->young++;
+      wss_keep_young(vm_normal_page(vma, addr, *pte));
+    }
+  }
+  pte_unmap_unlock(start, ptl);
+
+out:
+  ws->scanned += (end - first) >> PAGE_SHIFT;
+  if (ws->scanned >= ws->budget) {
+    ws->next = end;
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Scans the next budget pages of a process's address space from its cursor,
+ * sleeps on mmap_sem so the lock must not be held
+ *
+ * PARAM scan pid and cursor in, results out
+ * PARAM budget pages to scan
+**/
+static void wss_scan_task(struct wss_scan *scan, unsigned long budget){
+  struct task_struct *task;
+  struct mm_struct *mm;
+  struct wss_walk ws = { .budget = budget };
+  struct mm_walk walk = {
+    .pmd_entry = wss_pmd_entry,
+    .private = &ws,
+  };
+  int ret = 0;
+
+  rcu_read_lock();
+  task = pid_task(find_vpid(scan->pid), PIDTYPE_PID);
+  if (task != NULL)
+    get_task_struct(task);
+  rcu_read_unlock();
+  if (task == NULL)
+    return;
+  mm = get_task_mm(task);
+  put_task_struct(task);
+  if (mm == NULL)
+    return;
+
+  walk.mm = mm;
+  down_read(&mm->mmap_sem);
+  if (scan->cursor < mm->highest_vm_end)
+    ret = walk_page_range(scan->cursor, mm->highest_vm_end, &walk);
+  up_read(&mm->mmap_sem);
+
+  scan->young = ws.young;
+  scan->done = ret != 1;
+  scan->cursor = scan->done ? 0 : ws.next;
+  scan->rss = get_mm_rss(mm);
+  scan->valid = 1;
+  mmput(mm);
+}
+
+/**
+ * Working Set Pass
+ * Advances every registered process's sweep by wss_scan_pages pages. The
+ * list is copied under the lock, scanned without it and the results are
+ * folded back into the processes still registered.
+**/
+static void wss_scan_pass(void){
+  struct wss_scan *scans;
+  mp_struct *entry;
+  unsigned long budget = READ_ONCE(wss_scan_pages);
+  int i, nr = 0;
+  u64 now;
+
+  if (!budget)
+    return;
+
+  spin_lock(&lock);
+  scans = kcalloc(list_size, sizeof(struct wss_scan), GFP_ATOMIC);
+  if (scans != NULL) {
+    list_for_each_entry(entry, &head.list, list) {
+      scans[nr].pid = entry->pid;
+      scans[nr].cursor = entry->wss_cursor;
+      nr++;
+    }
+  }
+  spin_unlock(&lock);
+  if (scans == NULL)
+    return;
+
+  for (i = 0; i < nr; i++) {
+    wss_scan_task(&scans[i], budget);
+    cond_resched();
+  }
+
+  now = _get_time();
+  spin_lock(&lock);
+  list_for_each_entry(entry, &head.list, list) {
+    for (i = 0; i < nr && (scans[i].pid != entry->pid || !scans[i].valid); i++)
+      ;
+    if (i == nr)
+      continue;
+    entry->wss_young += scans[i].young;
+    entry->wss_cursor = scans[i].cursor;
+    if (!scans[i].done)
+      continue;
+
+    // The first sweep only clears the bits set before registration
+    if (entry->wss_sweeps++) {
+      entry->wss_size = entry->wss_young;
+      entry->rss_size = scans[i].rss;
+      entry->wss_window = now - entry->wss_start;
+      entry->wss_ready = 1;
+    }
+    entry->wss_young = 0;
+    entry->wss_start = now;
+  }
+  spin_unlock(&lock);
+  kfree(scans);
+}
+
+#ifdef CONFIG_X86_64
+// handle_mm_fault(vma, address, flags), the first arguments are in rdi and rsi
+#define FAULT_ARG_VMA(regs) ((struct vm_area_struct *)(regs)->di)
+#define FAULT_ARG_ADDRESS(regs) ((regs)->si)
+#endif
+
+/**
+ * Republishes the registered pids to the fault probe, lock held
+**/
+static void fault_pids_update(void){
+  struct fault_pids *pids, *old;
+  mp_struct *entry;
+
+  if (fault_tables == NULL)
+    return;
+
+  // On failure the probe keeps the previous pids
+  pids = kmalloc(sizeof(struct fault_pids) + list_size * sizeof(int), GFP_ATOMIC);
+  if (pids == NULL)
+    return;
+  pids->nr = 0;
+  list_for_each_entry(entry, &head.list, list)
+    pids->pids[pids->nr++] = entry->pid;
+
+  old = rcu_dereference_protected(fault_pids, lockdep_is_held(&lock));
+  rcu_assign_pointer(fault_pids, pids);
+  if (old != NULL)
+    kfree_rcu(old, rcu);
+}
+
+/**
+ * Mapping kind of a VMA, as /proc/<pid>/maps names them
+ *
+ * RETURN MP3_VMA_* kind
+**/
+static u16 fault_kind(struct vm_area_struct *vma){
+  struct mm_struct *mm = vma->vm_mm;
+
+  if (vma->vm_file != NULL)
+    return shmem_file(vma->vm_file) ? MP3_VMA_SHARED : MP3_VMA_FILE;
+  if (vma->vm_start <= mm->brk && vma->vm_end >= mm->start_brk)
+    return MP3_VMA_HEAP;
+  if (vma->vm_start <= mm->start_stack && vma->vm_end >= mm->start_stack)
+    return MP3_VMA_STACK;
+  if (vma->vm_flags & VM_SHARED)
+    return MP3_VMA_SHARED;
+  return MP3_VMA_ANON;
+}
+
+/**
+ * handle_mm_fault Entry Probe
+ * Keeps the mapping of a registered process's fault for the return probe
+ *
+ * RETURN 0 to probe the return, 1 to skip faults of other processes
+**/
+static int fault_entry_handler(struct kretprobe_instance *ri, struct pt_regs *regs){
+#ifdef FAULT_ARG_VMA
+  struct fault_probe *probe = (struct fault_probe *)ri->data;
+  struct vm_area_struct *vma = FAULT_ARG_VMA(regs);
+  unsigned int shift = min(READ_ONCE(vma_fault_shift), (unsigned int)BITS_PER_LONG - 1);
+  struct fault_pids *pids;
+  int i, found = 0;
+
+  if (current->mm == NULL || vma == NULL)
+    return 1;
+
+  rcu_read_lock();
+  pids = rcu_dereference(fault_pids);
+  for (i = 0; pids != NULL && i < pids->nr && !found; i++)
+    found = pids->pids[i] == current->tgid;
+  rcu_read_unlock();
+  if (!found)
+    return 1;
+
+  probe->pid = current->tgid;
+  probe->kind = fault_kind(vma);
+  probe->key = shift ? FAULT_ARG_ADDRESS(regs) & ~((1UL << shift) - 1) : vma->vm_start;
+  return 0;
+#else
+  return 1;
+#endif
+}
+
+/**
+ * handle_mm_fault Return Probe
+ * Counts the fault in this CPU's table, major when it needed I/O
+ *
+ * RETURN 0
+**/
+static int fault_ret_handler(struct kretprobe_instance *ri, struct pt_regs *regs){
+  struct fault_probe *probe = (struct fault_probe *)ri->data;
+  unsigned long ret = regs_return_value(regs);
+  struct fault_table *table;
+  struct fault_entry *entry = NULL;
+  unsigned long flags;
+  unsigned int i, slot;
+
+  // Failed faults are not counted, retried ones are counted on the retry
+  if (ret & (VM_FAULT_ERROR | VM_FAULT_RETRY))
+    return 0;
+
+  table = this_cpu_ptr(fault_tables);
+  slot = hash_long(probe->key ^ probe->pid ^ probe->kind, FAULT_BITS);
+  spin_lock_irqsave(&table->lock, flags);
+  for (i = 0; i < FAULT_SLOTS; i++) {
+    entry = &table->slots[(slot + i) & (FAULT_SLOTS - 1)];
+    if (entry->pid == 0) {
+      entry->pid = probe->pid;
+      entry->kind = probe->kind;
+      entry->key = probe->key;
+      table->nr++;
+      break;
+    }
+    if (entry->pid == probe->pid && entry->key == probe->key && entry->kind == probe->kind)
+      break;
+  }
+  if (i == FAULT_SLOTS)
+    table->lost++;
+  else if (ret & VM_FAULT_MAJOR)
+    entry->maj_flt++;
+  else
+    entry->min_flt++;
+  spin_unlock_irqrestore(&table->lock, flags);
+  return 0;
+}
+
+static struct kretprobe fault_kretprobe = {
+  .kp.symbol_name = "handle_mm_fault",
+  .entry_handler = fault_entry_handler,
+  .handler = fault_ret_handler,
+  .data_size = sizeof(struct fault_probe),
+};
+
+/**
+ * Counts the entries of every CPU's fault table, lock held
+ *
+ * RETURN VMA records fault_drain would write now
+**/
+static u64 fault_count(void){
+  struct fault_table *table;
+  unsigned long flags;
+  u64 nr = 0;
+  int cpu;
+
+  if (fault_tables == NULL)
+    return 0;
+
+  for_each_possible_cpu(cpu) {
+    table = per_cpu_ptr(fault_tables, cpu);
+    spin_lock_irqsave(&table->lock, flags);
+    nr += table->nr;
+    spin_unlock_irqrestore(&table->lock, flags);
+  }
+  return nr;
+}
+
+/**
+ * Moves every CPU's fault table into the pass, lock held
+ * Records past ring_space are counted but not written, with a ring_space of
+ * 0 the tables are emptied and nothing is written
+ *
+ * PARAM ring_head sequence of the pass's TICK
+ * PARAM ring_space free slots from ring_head on
+ * PARAM nr records of the pass so far
+ * RETURN records of the pass with the VMA records
+**/
+static u64 fault_drain(u64 ring_head, u64 ring_space, u64 nr){
+  struct fault_table *table;
+  struct fault_entry *entry;
+  struct mp3_record * record;
+  unsigned long flags;
+  int cpu, i;
+
+  if (fault_tables == NULL)
+    return nr;
+
+  for_each_possible_cpu(cpu) {
+    table = per_cpu_ptr(fault_tables, cpu);
+    spin_lock_irqsave(&table->lock, flags);
+    for (i = 0; i < FAULT_SLOTS && table->nr; i++) {
+      entry = &table->slots[i];
+      if (entry->pid == 0)
+        continue;
+      if (nr < ring_space) {
+        record = ring_claim(ring_head + nr);
+        record->type = MP3_REC_VMA;
+        record->count = entry->kind;
+        record->pid = entry->pid;
+        record->u.vma.start = entry->key;
+        record->u.vma.min_flt = entry->min_flt;
+        record->u.vma.maj_flt = entry->maj_flt;
+      }
+      nr++;
+    }
+    if (table->lost)
+      if(DEBUG) printk(KERN_ALERT "CPU %d LOST %lu FAULTS, TABLE FULL\n", cpu, table->lost);
+    memset(table->slots, 0, sizeof(table->slots));
+    table->nr = 0;
+    table->lost = 0;
+    spin_unlock_irqrestore(&table->lock, flags);
+  }
+  return nr;
+}
+
+/**
+ * Starts fault attribution when the vma_faults parameter asks for it, a
+ * failure leaves the rest of the profiler running
+**/
+static void fault_init(void){
+  int cpu, ret;
+
+  if (!vma_faults)
+    return;
+#ifndef FAULT_ARG_VMA
+  printk(KERN_INFO "MP3 FAULT ATTRIBUTION UNSUPPORTED ON THIS ARCHITECTURE\n");
+  return;
+#endif
+
+  fault_tables = alloc_percpu(struct fault_table);
+  if (fault_tables == NULL)
+    return;
+  for_each_possible_cpu(cpu)
+    spin_lock_init(&per_cpu_ptr(fault_tables, cpu)->lock);
+
+  // Major faults sleep on I/O inside the probe, allow plenty in flight
+  fault_kretprobe.maxactive = max(20U, 16 * num_possible_cpus());
+  ret = register_kretprobe(&fault_kretprobe);
+  if (ret < 0) {
+    printk(KERN_INFO "MP3 FAULT PROBE FAILED %d\n", ret);
+    free_percpu(fault_tables);
+    fault_tables = NULL;
+  }
+}
+
+/**
+ * Stops fault attribution, the probe is gone before the tables are freed
+**/
+static void fault_exit(void){
+  if (fault_tables == NULL)
+    return;
+  unregister_kretprobe(&fault_kretprobe);
+  free_percpu(fault_tables);
+  fault_tables = NULL;
+  kfree(rcu_dereference_protected(fault_pids, 1));
+  RCU_INIT_POINTER(fault_pids, NULL);
+}
+
+/**
+ * Next sampling interval, lock held
+ *
+ * PARAM faults faults seen by the pass
+ * PARAM active PID records the pass produced
+ * RETURN interval in nanoseconds
+**/
+static u64 next_interval(unsigned long faults, u64 active){
+  u64 lo = (u64)max(READ_ONCE(min_interval_us), 1U) * NSEC_PER_USEC;
+  u64 hi = (u64)READ_ONCE(max_interval_us) * NSEC_PER_USEC;
+
+  if (hi < lo)
+    hi = lo;
+  // Bursts are followed closely, idle processes are sampled ever less often
+  if (faults)
+    sample_interval /= 2;
+  else if (!active)
+    sample_interval *= 2;
+  sample_interval = clamp(sample_interval, lo, hi);
+  return sample_interval;
+}
+
+/**
+ * Writes the PID and WSS records of the samples update_runtimes took, lock held
+ * Records past ring_space are counted but not written, with a ring_space of
+ * 0 the completed sweeps are discarded and nothing is written
+ *
+ * PARAM ring_head sequence of the pass's TICK
+ * PARAM ring_space free slots from ring_head on
+ * PARAM nr records of the pass so far
+ * RETURN records of the pass with the PID and WSS records
+**/
+static u64 pid_drain(u64 ring_head, u64 ring_space, u64 nr){
+  struct mp3_record * record;
+  mp_struct *entry;
+
+  list_for_each_entry(entry, &head.list, list) {
+    // Zero suppression, idle processes take no record
+    if (entry->min_flt || entry->maj_flt || entry->utime || entry->stime) {
+      if (nr < ring_space) {
+        record = ring_claim(ring_head + nr);
+        record->type = MP3_REC_PID;
+        record->count = 0;
+        record->pid = entry->pid;
+        record->u.delta.min_flt = ring_delta(entry->min_flt);
+        record->u.delta.maj_flt = ring_delta(entry->maj_flt);
+        record->u.delta.utime = ring_delta(entry->utime);
+        record->u.delta.stime = ring_delta(entry->stime);
+      }
+      nr++;
+    }
+
+    // Working set of a sweep completed by wss_scan_pass
+    if (entry->wss_ready) {
+      if (nr < ring_space) {
+        record = ring_claim(ring_head + nr);
+        record->type = MP3_REC_WSS;
+        record->count = 0;
+        record->pid = entry->pid;
+        record->u.wss.wss = ring_delta(entry->wss_size);
+        record->u.wss.rss = ring_delta(entry->rss_size);
+        record->u.wss.window = entry->wss_window;
+      }
+      entry->wss_ready = 0;
+      nr++;
+    }
+  }
+  return nr;
+}
 
 /**
  * Bottom Half
  * Updates Process Usage and fault counts
 **/
-static void update_runtimes(void){
-  int ret;
-  unsigned long utime, stime, current_time;
-  unsigned long maj_flt, min_flt;
-  long all_maj_flt = 0;
-  long allutime = 0;
-  long all_min_flt = 0;
+static void update_runtimes(struct work_struct *work){
+  int ret, removed = 0, wake = 0;
+  unsigned long faults = 0;
+  struct mp3_record * record;
+  u64 ring_head, ring_space, nr = 1, active = 0, current_time;
+
+  // Page tables are walked before the pass, outside the lock
+  wss_scan_pass();
 
   spin_lock(&lock);
+
+  // Slot ring_head is kept for the TICK, PID, WSS and VMA records follow it
+  ring_head = ring->head;
+  ring_space = ring->nr_records;
+
   list_for_each_safe(pos, q, &head.list){
     tmp = list_entry(pos, mp_struct, list);
-    ret = get_cpu_use(tmp->pid, &min_flt, &maj_flt, &utime, &stime);
+    ret = sample_cpu_use(tmp, &(tmp->min_flt), &(tmp->maj_flt), &(tmp->utime), &(tmp->stime));
 
     // Updates information if returned, else delete object
     if (!ret) {
-      if(stime + utime > 0)
-        if(DEBUG) printk(KERN_ALERT "BOTTOM %d %lu %lu\n",tmp->pid, utime, stime);
-
-      tmp->min_flt = min_flt;
-      tmp->maj_flt = maj_flt;
-      
-      tmp->process_usage = utime + stime;
-      all_min_flt+=tmp->min_flt;
-      all_maj_flt+=tmp->maj_flt;
-      allutime+=tmp->process_usage;
+      // Commented out to avoid flooding logs at the sampling rate
+      // if(DEBUG) printk(KERN_ALERT "BOTTOM %d %lu %lu\n",tmp->pid, tmp->utime, tmp->stime);
+
+      tmp->process_usage = tmp->utime + tmp->stime;
+      faults += tmp->min_flt + tmp->maj_flt;
+
+      // Records are only counted here, pid_drain writes them once the pass fits
+      if (tmp->min_flt || tmp->maj_flt || tmp->utime || tmp->stime) {
+        nr++;
+        active++;
+      }
+      if (tmp->wss_ready)
+        nr++;
     
     } else {
       //Deletes processes that are killed from linked list
@@ -168,27 +977,58 @@ static void update_runtimes(void){
       list_del(pos);
       kfree(tmp);
       list_size--;
+      removed = 1;
     
     }
   }
+  if (removed)
+    fault_pids_update();
+
+  // Faults counted per mapping since the previous pass
+  nr += fault_count();
+
+  // The pass is sized before any slot is claimed, so a pass that does not
+  // fit retires no records and is dropped whole
+  if (nr > ring_space) {
+    WRITE_ONCE(ring->dropped, ring->dropped + nr);
+    ring_space = 0;
+  }
+  nr = pid_drain(ring_head, ring_space, 1);
+  nr = fault_drain(ring_head, ring_space, nr);
+
+  // Faults recorded since fault_count may not fit, only they are dropped
+  if (ring_space && nr > ring_space) {
+    WRITE_ONCE(ring->dropped, ring->dropped + nr - ring_space);
+    nr = ring_space;
+  }
 
   // Store updated information with buffer
   current_time = _get_time();
-  shared_buffer[shared_index++] = current_time;
-  shared_buffer[shared_index++] = all_min_flt;
-  shared_buffer[shared_index++] = all_maj_flt;
-  
-  // Get the total usage of all processes in terms of jiffies
-  // Loop around shared buffer for monitor to read (48000)
-  shared_buffer[shared_index++] = allutime;// * 100 / (current_time - last_time);
-  shared_index %= 48000;
+  if (ring_space) {
+    record = ring_claim(ring_head);
+    record->type = MP3_REC_TICK;
+    record->count = nr - 1 > U16_MAX ? U16_MAX : nr - 1;
+    record->pid = 0;
+    record->u.tick.time = current_time;
+    record->u.tick.interval = current_time - last_time;
+    smp_store_release(&ring->head, ring_head + nr);
+  }
   last_time = current_time;
-  spin_unlock(&lock);
 
   // Call Top Half if its not empty
-  if(list_size){
-    _reg_work(1);
+  if(list_size && sampling){
+    hrtimer_start(&sample_timer, ns_to_ktime(next_interval(faults, active)), HRTIMER_MODE_REL);
+  }
+
+  // Readers sleep until a batch is worth their wakeup
+  if (ring->head - wake_head >= ring_threshold()) {
+    wake_head = ring->head;
+    wake = 1;
   }
+  spin_unlock(&lock);
+
+  if (wake)
+    wake_up_interruptible(&ring_wait);
   
   // Commented out to avoid flooding logs
   // if(DEBUG) printk(KERN_ALERT "FINISHED UPDATING RUNTIMES\n");
@@ -196,27 +1036,32 @@ static void update_runtimes(void){
 
 /**
  * Top Half
- * Queue delayed work to update process usage and fault counts
+ * Sample timer expiry, queues the bottom half
  *
- * PARAM from_bottom_half boolean value for if top half is called from bottom half
-**/
-static void _reg_work(int from_bottom_half){
-  if ((from_bottom_half && list_size) || (list_size == 1)) {
-    struct delayed_work *work = (struct delayed_work *)kmalloc(sizeof(struct delayed_work), GFP_KERNEL);
-    if (work) {
-       INIT_DELAYED_WORK((struct delayed_work *) work, update_runtimes);
-       queue_delayed_work(queue, (struct delayed_work *) work, msecs_to_jiffies(1000/20));
-    }
+ * RETURN HRTIMER_NORESTART, the bottom half rearms the timer
+**/
+static enum hrtimer_restart sample_timer_fn(struct hrtimer *timer){
+  queue_work(queue, &sample_work);
+  return HRTIMER_NORESTART;
+}
+
+/**
+ * Starts sampling once the first process registers, lock held
+**/
+static void _reg_work(void){
+  if (list_size == 1 && sampling) {
+    hrtimer_start(&sample_timer, ns_to_ktime(sample_interval), HRTIMER_MODE_REL);
   }
 }
 
 /**
  * Proc Filesystem
- * Register User Application
+ * Register User Application, lock held
  *
  * PARAM user_message string from user
+ * PARAM task unused mp_struct, the list takes it over
 **/
-static void proc_fs_register(char * user_message) {
+static void proc_fs_register(char * user_message, mp_struct * task) {
   int pid;
 
   sscanf(user_message, "R %u", &pid);
@@ -225,20 +1070,37 @@ static void proc_fs_register(char * user_message) {
     last_time = _get_time();
   }
 
-  // Allocate new struct 
-  tmp = (mp_struct *)kmalloc(sizeof(mp_struct), GFP_KERNEL);
-  tmp->pid = pid;
-  tmp->process_usage = 0;
-  tmp->maj_flt = 0;
-  tmp->min_flt = 0;
-  tmp->linuxtask = find_task_by_pid(tmp->pid);
+  // Fill in the struct mp3_write allocated before taking the lock
+  task->pid = pid;
+  task->process_usage = 0;
+  task->maj_flt = 0;
+  task->min_flt = 0;
+  task->utime = 0;
+  task->stime = 0;
+  task->linuxtask = find_task_by_pid(task->pid);
+
+  // Working set sweeps start from the bottom of the address space
+  task->wss_cursor = 0;
+  task->wss_young = 0;
+  task->wss_start = _get_time();
+  task->wss_sweeps = 0;
+  task->wss_ready = 0;
+
+  // Deltas start at registration, counters before it are not profiled
+  if (read_cpu_use(pid, &(task->prev_min_flt), &(task->prev_maj_flt), &(task->prev_utime), &(task->prev_stime))) {
+    task->prev_min_flt = 0;
+    task->prev_maj_flt = 0;
+    task->prev_utime = 0;
+    task->prev_stime = 0;
+  }
 
   // Update list_struct
-  list_add_tail(&(tmp->list), &(head.list));
+  list_add_tail(&(task->list), &(head.list));
   list_size++;
+  fault_pids_update();
 
   // Call Top Half
-  _reg_work(0);
+  _reg_work();
 
   if(DEBUG) printk(KERN_ALERT "Registered %d", pid);
 }
@@ -268,56 +1130,53 @@ static void proc_fs_unregister(char * user_message) {
       list_size--;
       kfree(tmp);
       tmp = NULL;
+      fault_pids_update();
       
       if(DEBUG) printk(KERN_ALERT "PROCESS: %d UNREGISTERED PROPERLY\n", pid);
       return;
     }
   }
-
-  if (list_size == 0) {
-    _del_work_queue();
-  }
 }
 
 /**
  * Proc Filesystem
- * Loops through mp_struct list printing all mp_structs to user
- *
- * RETURN number of bytes left in buffer
+ * Status file iterator, streams one mp_struct per step
+ * The lock is held for one read buffer at a time and seq_file resumes at *ppos
 **/
-static ssize_t mp3_read(struct file *file, char __user *buffer, size_t count, loff_t *ppos){
-  int retval;
-  if(DEBUG) printk(KERN_INFO "SENDING PIDS");
-  
-  //If ppos > 0, then that means this is the second time being called and all data has been sent 
-  //If list_size == 0, that means the list is empty and we should return immediately
-  if((int)*ppos > 0 || !list_size) { 
-    return 0; 
-  }
-
-  // Loops through mp_struct list
+static void *mp3_seq_start(struct seq_file *m, loff_t *pos){
   spin_lock(&lock);
-  list_for_each_safe(pos, q, &head.list){
-    // Generate string
-    char my_buf[BUFSIZE];
-    tmp = list_entry(pos, mp_struct, list);
-    sprintf(my_buf,"%d\n", tmp->pid);
+  return seq_list_start(&head.list, *pos);
+}
 
-    // Copy to buffer
-    if(DEBUG) printk(KERN_INFO "SENDING %s\n", my_buf);
-    if (copy_to_user(buffer + *ppos, my_buf, strlen(my_buf)+1)) {
-      return -EFAULT;
-    }
+static void *mp3_seq_next(struct seq_file *m, void *v, loff_t *pos){
+  return seq_list_next(v, &head.list, pos);
+}
 
-    // Update position
-    *ppos += strlen(my_buf);
-  }
+static void mp3_seq_stop(struct seq_file *m, void *v){
   spin_unlock(&lock);
+}
 
-  //Makes sure that retval is not 0 and it is less than count so that buffer is sent back as intended
-  retval = count - *ppos;
-  if(DEBUG) printk(KERN_INFO "SENT PIDS");
-  return retval;
+/**
+ * Proc Filesystem
+ * Prints one mp_struct to user
+ *
+ * RETURN 0
+**/
+static int mp3_seq_show(struct seq_file *m, void *v){
+  mp_struct *task = list_entry(v, mp_struct, list);
+  seq_printf(m, "%d\n", task->pid);
+  return 0;
+}
+
+static const struct seq_operations mp3_seq_ops = {
+  .start = mp3_seq_start,
+  .next = mp3_seq_next,
+  .stop = mp3_seq_stop,
+  .show = mp3_seq_show,
+};
+
+static int mp3_status_open(struct inode *inode, struct file *file){
+  return seq_open(file, &mp3_seq_ops);
 }
 
 /**
@@ -327,18 +1186,28 @@ static ssize_t mp3_read(struct file *file, char __user *buffer, size_t count, lo
  * RETURN copied data count
 **/
 static ssize_t mp3_write(struct file *file, const char __user *buffer, size_t count, loff_t *data){
-  int to_copy;
-  char user_message[count];
+  size_t to_copy = min(count, (size_t)BUFSIZE - 1);
+  char user_message[BUFSIZE];
+  mp_struct * task = NULL;
   if(DEBUG) printk(KERN_INFO "RECEIVING PID");
 
-  // Initialize memory for new linked list object
-  to_copy = copy_from_user(user_message, buffer, count);
+  // Copy and terminate the message, at most BUFSIZE - 1 bytes of it
+  if (copy_from_user(user_message, buffer, to_copy))
+    return -EFAULT;
+  user_message[to_copy] = '\0';
+
+  // Initialize memory for new linked list object, the lock is a spinlock
+  if (user_message[0] == 'R') {
+    task = (mp_struct *)kmalloc(sizeof(mp_struct), GFP_KERNEL);
+    if (task == NULL)
+      return -ENOMEM;
+  }
 
   // Proc FS systems
   spin_lock(&lock);
   switch(user_message[0]) {
     case 'R' :
-      proc_fs_register(user_message);
+      proc_fs_register(user_message, task);
       break;
     case 'U' :
       proc_fs_unregister(user_message);
@@ -347,8 +1216,8 @@ static ssize_t mp3_write(struct file *file, const char __user *buffer, size_t co
   spin_unlock(&lock);
   if(DEBUG) printk(KERN_ALERT "PROCESS %c", user_message[0]);
 
-  *data += count - to_copy;
-  return count - to_copy;
+  *data += count;
+  return count;
 }
 
 /**
@@ -357,50 +1226,150 @@ static ssize_t mp3_write(struct file *file, const char __user *buffer, size_t co
 **/
 static const struct file_operations mp_file_fops = {
   .owner = THIS_MODULE,
-  .read = mp3_read,
+  .open = mp3_status_open,
+  .read = seq_read,
   .write = mp3_write,
+  .llseek = seq_lseek,
+  .release = seq_release,
 };
 
 /**
  * Shared Buffer Filesystem
 **/
 static int mp3_open(struct inode *inode, struct file *file){
+  struct mp3_reader *reader;
+
   if(DEBUG) printk(KERN_INFO "MP3 OPEN\n");
+
+  // Every open file reads from the oldest retained pass on its own
+  reader = kzalloc(sizeof(struct mp3_reader), GFP_KERNEL);
+  if (reader == NULL)
+    return -ENOMEM;
+  mutex_init(&reader->lock);
+  reader_sync(reader);
+  reader->dropped = 0;
+  reader->lost = 0;
+  file->private_data = reader;
   return 0;
 }
 
 static int mp3_release(struct inode *inode, struct file *file){
   if(DEBUG) printk(KERN_INFO "MP3 RELEASE\n");
+  kfree(file->private_data);
   return 0;
 }
 
 static int mp3_mmap(struct file *file, struct vm_area_struct * vm_area){
-  int ctr;
-  unsigned long pfn;
+  int ret;
 
-  if(DEBUG) printk(KERN_INFO "MP3 MMAP\n");
-  
-  ctr=0;
-  for(;ctr < 128; ctr++){
-    if(DEBUG) printk(KERN_INFO "MMAP LOOP %d\n", ctr);
-    
-    pfn = vmalloc_to_pfn((char *)(shared_buffer)+ctr*PAGESIZE);
-    
-    if(remap_pfn_range(vm_area,(unsigned long)(vm_area->vm_start)+ctr*PAGESIZE,pfn,PAGE_SIZE,PAGE_SHARED)){
-      if(DEBUG) printk(KERN_INFO "REMAPPING FAILED\n");
-      return -1;
+  // Consumers share the buffer, none of them may write to it
+  if (vm_area->vm_flags & VM_WRITE)
+    return -EPERM;
+  vm_area->vm_flags &= ~VM_MAYWRITE;
+
+  // Maps any page range of the buffer in one call, remap_vmalloc_range
+  // rejects areas that run past its end
+  ret = remap_vmalloc_range(vm_area, shared_buffer, vm_area->vm_pgoff);
+  if(DEBUG) printk(KERN_INFO "MP3 MMAP %lu PAGES AT %lu: %d\n",
+                   (vm_area->vm_end - vm_area->vm_start) / PAGESIZE, vm_area->vm_pgoff, ret);
+  return ret;
+}
+
+/**
+ * Character Device Read
+ * Copies whole records from the file's cursor on, blocking until wakeup
+ * records wait unless the file is O_NONBLOCK. Records the module overwrote
+ * before the file read them are reported first as one MP3_REC_LOST record.
+ *
+ * RETURN bytes read, a multiple of the record size
+**/
+static ssize_t mp3_read(struct file *file, char __user *buffer, size_t count, loff_t *data){
+  struct mp3_reader *reader = file->private_data;
+  struct mp3_record lost;
+  u64 head, tail, nr, copied, index, chunk;
+  size_t offset;
+  ssize_t ret;
+  u32 slot;
+
+  if (count < sizeof(struct mp3_record))
+    return -EINVAL;
+
+  if (mutex_lock_interruptible(&reader->lock))
+    return -ERESTARTSYS;
+  for (;;) {
+    reader_sync(reader);
+    head = smp_load_acquire(&ring->head);
+    if (reader_ready(reader) || ((file->f_flags & O_NONBLOCK) && reader->cursor < head))
+      break;
+    mutex_unlock(&reader->lock);
+    if (file->f_flags & O_NONBLOCK)
+      return -EAGAIN;
+    if (wait_event_interruptible(ring_wait, reader_ready(reader)))
+      return -ERESTARTSYS;
+    if (mutex_lock_interruptible(&reader->lock))
+      return -ERESTARTSYS;
+  }
+
+retry:
+  reader_sync(reader);
+  offset = reader->lost ? sizeof(struct mp3_record) : 0;
+  head = smp_load_acquire(&ring->head);
+  nr = min_t(u64, head - reader->cursor, (count - offset) / sizeof(struct mp3_record));
+
+  // The ring may wrap, copy up to its end and then from its start
+  for (copied = 0; copied < nr; copied += chunk) {
+    div_u64_rem(reader->cursor + copied, ring->nr_records, &slot);
+    index = slot;
+    chunk = min_t(u64, nr - copied, ring->nr_records - index);
+    if (copy_to_user(buffer + offset + copied * sizeof(struct mp3_record), &ring_records[index],
+                     chunk * sizeof(struct mp3_record))) {
+      ret = -EFAULT;
+      goto out;
     }
   }
 
-  if(DEBUG) printk(KERN_INFO "END MP3 MMAP\n");
+  // Pairs with ring_claim, a record rewritten during the copy has left tail
+  // behind it and the copy is redone from the oldest retained pass
+  smp_rmb();
+  tail = READ_ONCE(ring->tail);
+  if (tail > reader->cursor)
+    goto retry;
+
+  if (offset) {
+    memset(&lost, 0, sizeof(struct mp3_record));
+    lost.type = MP3_REC_LOST;
+    lost.u.lost.records = reader->lost;
+    lost.u.lost.dropped = reader->dropped;
+    if (copy_to_user(buffer, &lost, sizeof(struct mp3_record))) {
+      ret = -EFAULT;
+      goto out;
+    }
+    reader->lost = 0;
+  }
+  WRITE_ONCE(reader->cursor, reader->cursor + nr);
+  ret = offset + nr * sizeof(struct mp3_record);
 
-  return 0;
+out:
+  mutex_unlock(&reader->lock);
+  return ret;
+}
+
+/**
+ * Character Device Poll
+ *
+ * RETURN readable once wakeup records wait for this file
+**/
+static unsigned int mp3_poll(struct file *file, poll_table *wait){
+  poll_wait(file, &ring_wait, wait);
+  return reader_ready(file->private_data) ? POLLIN | POLLRDNORM : 0;
 }
 
 static const struct file_operations mp_mmap_fops = {
   .owner = THIS_MODULE,
   .open = mp3_open,
   .release = mp3_release,
+  .read = mp3_read,
+  .poll = mp3_poll,
   .mmap = mp3_mmap,
 };
 
@@ -411,7 +1380,7 @@ static const struct file_operations mp_mmap_fops = {
 **/
 int __init mp3_init(void)
 {
-  int ctr;
+  int ret;
 
   #ifdef DEBUG
   if(DEBUG) printk(KERN_INFO "MODULE LOADING\n");
@@ -421,18 +1390,39 @@ int __init mp3_init(void)
   spin_lock_init(&lock);
   if(DEBUG) printk(KERN_INFO "INITIALIZED SPINLOCK\n");
 
-  // Allocate Virtual Buffer and init to -1
-  shared_buffer = vmalloc(SHAREDBUFSIZE);
-  ctr=0;
-  for(;ctr < SHAREDBUFSIZE/LONGSIZE;ctr++){
-     shared_buffer[ctr] = -1;
+  // Allocate Virtual Buffer and init the ring header
+  if (ring_pages == 0)
+    ring_pages = 1;
+  shared_size = (unsigned long)(ring_pages + 1) * PAGESIZE;
+  // vmalloc_user zeroes the pages and marks them mappable by remap_vmalloc_range
+  shared_buffer = vmalloc_user(shared_size);
+  if (!shared_buffer)
+    return -ENOMEM;
+  ring = shared_buffer;
+  ring->magic = MP3_RING_MAGIC;
+  ring->version = MP3_RING_VERSION;
+  ring->record_size = sizeof(struct mp3_record);
+  ring->data_offset = PAGESIZE;
+  ring->nr_records = ring_pages * PAGESIZE / sizeof(struct mp3_record);
+  ring_records = (struct mp3_record *)((char *)shared_buffer + PAGESIZE);
+
+  // Creates Character Device Driver and adds to Kernel, the major number
+  // is listed in /proc/devices
+  ret = alloc_chrdev_region(&cdev_number, 0, 1, DEVICE_NAME);
+  if (ret < 0) {
+    vfree(shared_buffer);
+    return ret;
   }
-
-  // Creates Character Device Driver and adds to Kernel
-  //cdev_init(&cdevdata, &mp_mmap_fops);
-  //ret = cdev_add(&cdevdata, 150, 1);
-  //if(DEBUG && ret<0) printk(KERN_INFO "ADDING CDEV FAILED\n");
-  register_chrdev(150,"node",&mp_mmap_fops);
+  cdev_init(&cdevdata, &mp_mmap_fops);
+  cdevdata.owner = THIS_MODULE;
+  ret = cdev_add(&cdevdata, cdev_number, 1);
+  if (ret < 0) {
+    if(DEBUG) printk(KERN_INFO "ADDING CDEV FAILED\n");
+    unregister_chrdev_region(cdev_number, 1);
+    vfree(shared_buffer);
+    return ret;
+  }
+  if(DEBUG) printk(KERN_INFO "CDEV %d:%d\n", MAJOR(cdev_number), MINOR(cdev_number));
 
   // Creates /proc/mp2/status
   proc_dir = proc_mkdir(DIRECTORY, NULL);
@@ -443,8 +1433,14 @@ int __init mp3_init(void)
   INIT_LIST_HEAD(&head.list);
   if(DEBUG) printk(KERN_INFO "INITIALIZE mp_struct head\n");
 
-  // Initialize Workqueue
+  // Initialize Workqueue and the sample timer feeding it
   _init_workqueue();
+  INIT_WORK(&sample_work, update_runtimes);
+  hrtimer_init(&sample_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+  sample_timer.function = sample_timer_fn;
+
+  // Probes faults for per mapping counts, if asked for
+  fault_init();
 
   if(DEBUG) printk(KERN_ALERT "MODULE LOADED\n");
   return 0;   
@@ -461,15 +1457,24 @@ void __exit mp3_exit(void)
   if(DEBUG) printk(KERN_ALERT "MODULE UNLOADING\n");
   #endif
 
-  // Free Buffer
-  vfree(shared_buffer);
-
-  // Frees work queue
+  // Stops sampling so neither the timer nor the work rearms the other, then
+  // frees work queue, before the buffer it writes to
+  spin_lock(&lock);
+  sampling = false;
+  spin_unlock(&lock);
+  hrtimer_cancel(&sample_timer);
+  cancel_work_sync(&sample_work);
   _del_work_queue();
 
+  // Removes the fault probe
+  fault_exit();
+
   // Deletes Character Device Driver from Kernel
-  //cdev_del(&cdevdata);
-  unregister_chrdev(150,"node");
+  cdev_del(&cdevdata);
+  unregister_chrdev_region(cdev_number, 1);
+
+  // Free Buffer
+  vfree(shared_buffer);
 
   // Deletes /proc/mp3/status
   proc_remove(proc_entry);
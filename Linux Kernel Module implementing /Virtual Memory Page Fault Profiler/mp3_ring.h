@@ -0,0 +1,153 @@
+#ifndef __MP3_RING_INCLUDE__
+#define __MP3_RING_INCLUDE__
+
+#include <linux/types.h>
+
+/**
+ * Profiling ring shared read-only through mmap of the mp3 character device,
+ * whose major number is allocated at load and listed in /proc/devices
+ *
+ * The first page holds a struct mp3_ring_header, the records start at
+ * data_offset. head and tail are free running sequence numbers, record
+ * seq lives at index seq % nr_records.
+ *
+ * Every sampling pass appends one MP3_REC_TICK record followed by one
+ * MP3_REC_PID record per registered process that faulted or ran since the
+ * previous pass, processes with all zero deltas are left out.
+ *
+ * With the wss_scan_pages module parameter set, every pass also walks that
+ * many pages of each process's page tables, testing and clearing accessed
+ * bits from where the previous pass stopped. A process whose sweep reached
+ * the end of its address space gets one MP3_REC_WSS record in the pass,
+ * the pages accessed since the previous sweep. The first sweep after
+ * registration only clears bits and is not recorded.
+ *
+ * With the vma_faults module parameter set, faults of registered processes
+ * are also counted per mapping, per VMA or per 2^vma_fault_shift byte
+ * address bucket, and every pass appends one MP3_REC_VMA record per
+ * mapping that faulted since the previous pass. Counts are kept per CPU, so
+ * a mapping can get one record per CPU in a pass and readers sum them.
+ *
+ * The module is the only writer and never waits for readers, the ring
+ * keeps the latest nr_records records [tail, head). Before a slot is
+ * overwritten tail moves past the record it held, then the record is
+ * written, and a whole pass is published at once with a release store of
+ * head. A pass larger than the whole ring is dropped before any of its
+ * records is written, so it retires nothing, and its records are counted in
+ * dropped. VMA records of faults taken while a pass is written that no
+ * longer fit are counted there as well.
+ *
+ * Readers keep their own cursor. An mmap reader loads head with acquire,
+ * copies records from its cursor up to head, and then loads tail after an
+ * acquire fence. Copied records below that tail may have been overwritten
+ * during the copy and must be discarded. After a reader falls behind tail
+ * it resumes at the next TICK.
+ *
+ * read() on the device does the same with a cursor per open file, which
+ * starts at the oldest retained pass. Records overwritten before the file
+ * read them are reported ahead of the rest as one MP3_REC_LOST record. read
+ * blocks until the wakeup module parameter worth of records wait for the
+ * file, or fails with EAGAIN on an O_NONBLOCK file with nothing to read,
+ * and poll reports the file readable at the same threshold.
+**/
+#define MP3_RING_MAGIC 0x33504d52U /* "RMP3" */
+#define MP3_RING_VERSION 6
+
+#define MP3_REC_TICK 1
+#define MP3_REC_PID 2
+#define MP3_REC_WSS 3
+#define MP3_REC_VMA 4
+#define MP3_REC_LOST 5
+
+#define MP3_VMA_ANON 0
+#define MP3_VMA_HEAP 1
+#define MP3_VMA_STACK 2
+#define MP3_VMA_FILE 3
+#define MP3_VMA_SHARED 4
+
+/**
+ * Ring Header
+ *
+ * magic MP3_RING_MAGIC
+ * version MP3_RING_VERSION
+ * record_size sizeof(struct mp3_record) as built into the module
+ * nr_records ring capacity in records
+ * data_offset byte offset of the first record from the header
+ * head records produced, written by the module
+ * tail oldest record still held, written by the module
+ * dropped records that did not fit in the ring, never written
+**/
+struct mp3_ring_header {
+  __u32 magic;
+  __u16 version;
+  __u16 record_size;
+  __u32 nr_records;
+  __u32 data_offset;
+  __u64 head;
+  __u64 tail;
+  __u64 dropped;
+};
+
+/**
+ * Profiling Record, 24 bytes
+ *
+ * type MP3_REC_TICK or MP3_REC_PID
+ * count TICK: number of PID, WSS and VMA records that follow, saturating at
+ *    65535, VMA: MP3_VMA_* kind of the mapping, otherwise 0
+ * pid PID, WSS, VMA: profiled process, TICK, LOST: 0
+ * tick.time TICK: CLOCK_MONOTONIC sample time in nanoseconds, shared by the
+ *    PID records after it
+ * tick.interval TICK: nanoseconds since the previous sampling pass, the
+ *    module adapts it to fault activity
+ * delta PID: counts since the process's previous PID record, each saturates
+ *    at 2^32 - 1
+ *    min_flt minor faults
+ *    maj_flt major faults
+ *    utime user cpu time in cputime units
+ *    stime system cpu time in cputime units
+ * wss WSS: pages sampled by the process's last completed sweep, saturating
+ *    at 2^32 - 1
+ *    wss pages accessed during the window
+ *    rss resident pages when the sweep completed
+ *    window nanoseconds the sweep took, the window accesses are counted over
+ * vma VMA: faults in one mapping since the previous pass
+ *    start start address of the VMA or of the address bucket
+ *    min_flt minor faults
+ *    maj_flt major faults
+ * lost LOST: only produced by read(), records this file missed
+ *    records records overwritten since the file's previous LOST record
+ *    dropped records overwritten since the file was opened
+**/
+struct mp3_record {
+  __u16 type;
+  __u16 count;
+  __s32 pid;
+  union {
+    struct {
+      __u64 time;
+      __u64 interval;
+    } tick;
+    struct {
+      __u32 min_flt;
+      __u32 maj_flt;
+      __u32 utime;
+      __u32 stime;
+    } delta;
+    struct {
+      __u32 wss;
+      __u32 rss;
+      __u64 window;
+    } wss;
+    struct {
+      __u64 start;
+      __u32 min_flt;
+      __u32 maj_flt;
+    } vma;
+    struct {
+      __u64 records;
+      __u64 dropped;
+    } lost;
+  } u;
+};
+
+#endif
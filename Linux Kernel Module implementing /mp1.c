@@ -19,6 +19,10 @@
 // Timer Libraries
 #include <linux/timer.h>
 #include <linux/jiffies.h>
+// Per-CPU Sampling
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/cpu.h>
 // WorkQueue
 #include <linux/workqueue.h>
 // String
@@ -28,8 +32,22 @@
 #include <linux/fcntl.h>
 // Spinlock
 #include <linux/spinlock.h>
+#include <linux/seqlock.h>
+// Sequential File
+#include <linux/seq_file.h>
+// Exit Notifier
+#include <linux/profile.h>
+#include <linux/notifier.h>
+// PID Hash Table
+#include <linux/hashtable.h>
+#include <linux/rculist.h>
+#include <linux/atomic.h>
+// Sample Timestamps
+#include <linux/ktime.h>
 // Given Functions
 #include "mp1_given.h"
+// Binary Interface
+#include "mp1_status.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Group_ID");
@@ -37,141 +55,658 @@ MODULE_DESCRIPTION("CS-423 MP1");
 
 #define DEBUG 0
 #define FILENAME "status"
+#define EXITED_FILENAME "exited"
 #define DIRECTORY "mp1"
+#define PID_HASH_BITS 10
 
 // /proc/mp1/status variables
 static struct proc_dir_entry *proc_dir;
 static struct proc_dir_entry *proc_entry;
+static struct proc_dir_entry *exited_entry;
 
-// PID Linux Kernel Linked List variables
-static struct pid_list head;
-static struct pid_list *tmp;
-static struct list_head *pos, *q;
-static int list_size = 0;
+// PID Index
+// pid_table hashes entries by their struct pid for O(1) register/lookup/expire
+// pid_order keeps registration order for the status file and the updater
+// Both are RCU protected: readers only take rcu_read_lock, writers take lock
+static DEFINE_HASHTABLE(pid_table, PID_HASH_BITS);
+static LIST_HEAD(pid_order);
+static atomic_t list_size = ATOMIC_INIT(0);
+
+// Sampling period, read again before every pass
+static unsigned int sample_period_ms = 5000;
+module_param(sample_period_ms, uint, 0644);
+MODULE_PARM_DESC(sample_period_ms, "Per-CPU sampling period in milliseconds (default 5000)");
+
+// Aggregate the whole thread group of every registered pid
+static bool tgid_rollup;
+module_param(tgid_rollup, bool, 0644);
+MODULE_PARM_DESC(tgid_rollup, "Sum cpu accounting over all threads of each registered pid (default 0)");
+
+// CPU Accounting Record
+//
+// utime user cpu time in cputime units
+// stime system cpu time in cputime units
+// nvcsw voluntary context switches
+// nivcsw involuntary context switches
+// wall_ns CLOCK_MONOTONIC time since the task started
+struct mp1_sample {
+   unsigned long utime;
+   unsigned long stime;
+   unsigned long nvcsw;
+   unsigned long nivcsw;
+   u64 wall_ns;
+};
+
+// Recently Exited Ring
+// Final accounting of tracked tasks, the oldest record is overwritten when full
+//
+// pid exited pid
+// sample final cpu accounting
+// exit_ns CLOCK_MONOTONIC time of exit
+struct mp1_exited {
+   int pid;
+   struct mp1_sample sample;
+   u64 exit_ns;
+};
+
+static unsigned int exited_ring_size = 256;
+module_param(exited_ring_size, uint, 0444);
+MODULE_PARM_DESC(exited_ring_size, "Number of exited tasks kept in /proc/mp1/exited (default 256)");
+
+static struct mp1_exited *exited_ring;
+static unsigned long exited_head;
+static DEFINE_SPINLOCK(exited_lock);
+
+// Per open file read format, stored in the seq_file private field
+#define MP1_MODE_TEXT 0
+#define MP1_MODE_BINARY 1
+
+// Per-CPU Sampler
+// Each CPU samples the tracked tasks that last ran on it
+//
+// lock protects tasks and the cpu field of the entries on it
+// tasks pid_list entries homed on this CPU
+// work statically embedded, rearms itself every sample_period_ms
+// epoch completed passes on this CPU
+// sample_ns CLOCK_MONOTONIC time of the last completed pass
+// cpu owning CPU
+struct mp1_sampler {
+   spinlock_t lock;
+   struct list_head tasks;
+   struct delayed_work work;
+   u64 epoch;
+   u64 sample_ns;
+   int cpu;
+};
 
 // Interrupt Variables
-static struct timer_list my_timer;
+static DEFINE_PER_CPU(struct mp1_sampler, samplers);
+static struct cpumask sampling_cpus;
 static struct workqueue_struct *queue;
-// Bypass circular declaration
-static void queue_timer_updates(void);
 
-// Semaphore Lock for /proc/mp1/status
+// Spinlock for PID Index writers
+// Nests outside of the mp1_sampler locks
 static spinlock_t lock;
 
 // Linux Kernel Linked List Struct
+//
+// pid user application pid
+// sample latest cpu accounting of the user application
+// seq sample consistency, written by the home sampler under its lock
+// pid_ref pinned struct pid, saves a find_vpid per entry per tick and
+//    keeps a recycled pid number from inheriting this entry
+// hnode pid_table chain
+// list pid_order list
+// cpu_list mp1_sampler tasks list
+// cpu home CPU, -1 once detached from every sampler
+// rcu deferred free
 struct pid_list {
    int pid;
-   int runtime;
+   struct mp1_sample sample;
+   seqcount_t seq;
+   struct pid *pid_ref;
+   struct hlist_node hnode;
    struct list_head list;
+   struct list_head cpu_list;
+   int cpu;
+   struct rcu_head rcu;
 };
 
-//Reads data in linked list and outputs it to the userspace
-static ssize_t mp1_read(struct file *file, char __user *buffer, size_t count, loff_t *ppos){
-   if (DEBUG) printk(KERN_ALERT "SENDING PIDS");
-	//If ppos > 0, then that means this is the second time being called and all data has been sent 
-	//If list_size == 0, that means the list is empty and we should return immediately
-	if((int)*ppos > 0 || !list_size)
-		return 0;
-	//Loops through each element in the list and stores the data into a string which is
-	//  sent out to userspace
-	spin_lock(&lock);
-       	  list_for_each_safe(pos, q, &head.list){
-	     char my_buf[64];
-       	     tmp = list_entry(pos, struct pid_list, list);
-	     sprintf(my_buf,"%d: %lu\n",tmp->pid,tmp->runtime);
-	     if(DEBUG) printk(KERN_ALERT "%d: %lu\n", tmp->pid,tmp->runtime);
-	     if (copy_to_user(buffer + *ppos, my_buf, strlen(my_buf)+1))
-	         return -EFAULT;
-	     *ppos += 64;
-       	  }
-	spin_unlock(&lock);
-	//Makes sure that retval is not 0 and it is less than count so that buffer is sent back as intended
-	    int retval = count - *ppos;
-
-	    if (DEBUG) printk(KERN_ALERT "SENT PIDS");
-	    return retval;
-}
-
-// Recieves PID from user and inits new pid_list struct
+// Finds the entry tracking pid_ref
+// Caller must hold rcu_read_lock or lock
+static struct pid_list *pid_index_find(struct pid *pid_ref){
+   struct pid_list *entry;
+
+   hash_for_each_possible_rcu(pid_table, entry, hnode, (unsigned long)pid_ref){
+      if (entry->pid_ref == pid_ref)
+         return entry;
+   }
+   return NULL;
+}
+
+// Frees an entry once all RCU readers are done with it
+static void pid_index_free_rcu(struct rcu_head *rcu){
+   struct pid_list *entry = container_of(rcu, struct pid_list, rcu);
+
+   put_pid(entry->pid_ref);
+   kfree(entry);
+}
+
+// Homes an entry on a sampling CPU
+// Caller must hold lock
+static void pid_index_home(struct pid_list *entry, int cpu){
+   struct mp1_sampler *sampler;
+
+   if (!cpumask_test_cpu(cpu, &sampling_cpus))
+      cpu = cpumask_first(&sampling_cpus);
+   sampler = per_cpu_ptr(&samplers, cpu);
+   spin_lock(&sampler->lock);
+   list_add_tail(&entry->cpu_list, &sampler->tasks);
+   entry->cpu = cpu;
+   spin_unlock(&sampler->lock);
+}
+
+// Detaches an entry from its sampling CPU
+// The home CPU can change under us until its sampler lock is held
+// Caller must hold lock
+static void pid_index_unhome(struct pid_list *entry){
+   struct mp1_sampler *sampler;
+   int cpu;
+
+   for (;;) {
+      cpu = READ_ONCE(entry->cpu);
+      if (cpu < 0)
+         return;
+      sampler = per_cpu_ptr(&samplers, cpu);
+      spin_lock(&sampler->lock);
+      if (entry->cpu == cpu) {
+         list_del(&entry->cpu_list);
+         entry->cpu = -1;
+         spin_unlock(&sampler->lock);
+         return;
+      }
+      spin_unlock(&sampler->lock);
+   }
+}
+
+// Collects the accounting record of task, or of its whole thread group
+// Threads that already exited are folded in through the signal struct
+// Caller must hold rcu_read_lock
+static void mp1_sample_task(struct task_struct *task, struct mp1_sample *sample){
+   struct signal_struct *sig = task->signal;
+   struct task_struct *t;
+
+   sample->wall_ns = ktime_get_ns() - task->start_time;
+   if (!READ_ONCE(tgid_rollup)) {
+      sample->utime = task->utime;
+      sample->stime = task->stime;
+      sample->nvcsw = task->nvcsw;
+      sample->nivcsw = task->nivcsw;
+      return;
+   }
+
+   sample->utime = sig->utime;
+   sample->stime = sig->stime;
+   sample->nvcsw = sig->nvcsw;
+   sample->nivcsw = sig->nivcsw;
+   for_each_thread(task, t) {
+      sample->utime += t->utime;
+      sample->stime += t->stime;
+      sample->nvcsw += t->nvcsw;
+      sample->nivcsw += t->nivcsw;
+   }
+}
+
+// Copies the latest accounting record of an entry
+static void mp1_read_sample(struct pid_list *entry, struct mp1_sample *sample){
+   unsigned int seq;
+
+   do {
+      seq = read_seqcount_begin(&entry->seq);
+      *sample = entry->sample;
+   } while (read_seqcount_retry(&entry->seq, seq));
+}
+
+// Records the final accounting of a tracked task in the Recently Exited Ring
+static void mp1_exited_push(int pid, struct mp1_sample *sample){
+   struct mp1_exited *record;
+
+   spin_lock(&exited_lock);
+   record = &exited_ring[exited_head % exited_ring_size];
+   record->pid = pid;
+   record->sample = *sample;
+   record->exit_ns = ktime_get_ns();
+   exited_head++;
+   spin_unlock(&exited_lock);
+}
+
+// Merges the per-CPU passes for the status view
+//
+// PARAM ns set to the time of the most recent pass
+// RETURN epoch every sampling CPU has reached
+static u64 mp1_sample_epoch(u64 *ns){
+   struct mp1_sampler *sampler;
+   u64 epoch = U64_MAX;
+   int cpu;
+
+   *ns = 0;
+   for_each_cpu(cpu, &sampling_cpus) {
+      sampler = per_cpu_ptr(&samplers, cpu);
+      epoch = min(epoch, READ_ONCE(sampler->epoch));
+      *ns = max(*ns, READ_ONCE(sampler->sample_ns));
+   }
+   return epoch == U64_MAX ? 0 : epoch;
+}
+
+// Unlinks an entry from the PID Index
+// Caller must hold lock, safe to call twice for the same entry
+static void pid_index_remove(struct pid_list *entry){
+   if (!hash_hashed(&entry->hnode))
+      return;
+   hash_del_rcu(&entry->hnode);
+   list_del_rcu(&entry->list);
+   pid_index_unhome(entry);
+   atomic_dec(&list_size);
+   call_rcu(&entry->rcu, pid_index_free_rcu);
+}
+
+// Status File Iterator
+// Streams one PID Index entry per step under rcu_read_lock, seq_file resumes
+//   at *ppos so the list can outgrow a single read buffer
+// Binary readers get a mp1_bin_header first, at position 0
+static void *mp1_seq_start(struct seq_file *m, loff_t *pos){
+   struct pid_list *entry;
+   loff_t off = *pos;
+
+   rcu_read_lock();
+   if (m->private == (void *)MP1_MODE_BINARY) {
+      if (off == 0)
+         return SEQ_START_TOKEN;
+      off--;
+   }
+   list_for_each_entry_rcu(entry, &pid_order, list){
+      if (off-- == 0)
+         return entry;
+   }
+   return NULL;
+}
+
+static void *mp1_seq_next(struct seq_file *m, void *v, loff_t *pos){
+   struct list_head *next;
+
+   ++*pos;
+   if (v == SEQ_START_TOKEN)
+      next = rcu_dereference(list_next_rcu(&pid_order));
+   else
+      next = rcu_dereference(list_next_rcu(&((struct pid_list *)v)->list));
+   if (next == &pid_order)
+      return NULL;
+   return list_entry(next, struct pid_list, list);
+}
+
+static void mp1_seq_stop(struct seq_file *m, void *v){
+   rcu_read_unlock();
+}
+
+static int mp1_seq_show(struct seq_file *m, void *v){
+   struct mp1_bin_header header;
+   struct mp1_bin_record record;
+   struct mp1_sample sample;
+   struct pid_list *entry = v;
+
+   if (v == SEQ_START_TOKEN) {
+      header.magic = MP1_BIN_MAGIC;
+      header.version = MP1_BIN_VERSION;
+      header.record_size = sizeof(record);
+      header.epoch = mp1_sample_epoch(&header.sample_ns);
+      seq_write(m, &header, sizeof(header));
+      return 0;
+   }
+
+   mp1_read_sample(entry, &sample);
+   if (m->private == (void *)MP1_MODE_BINARY) {
+      record.pid = entry->pid;
+      record.reserved = 0;
+      record.utime = sample.utime;
+      record.stime = sample.stime;
+      record.nvcsw = sample.nvcsw;
+      record.nivcsw = sample.nivcsw;
+      record.wall_ns = sample.wall_ns;
+      seq_write(m, &record, sizeof(record));
+   } else {
+      // "<pid>: <runtime>" prefix kept for existing parsers
+      seq_printf(m, "%d: %lu %lu %lu %lu %llu\n", entry->pid, sample.utime, sample.stime,
+                 sample.nvcsw, sample.nivcsw, sample.wall_ns);
+   }
+   return 0;
+}
+
+static const struct seq_operations mp1_seq_ops = {
+   .start = mp1_seq_start,
+   .next = mp1_seq_next,
+   .stop = mp1_seq_stop,
+   .show = mp1_seq_show,
+};
+
+// Opens /proc/mp1/status in text mode
+static int mp1_open(struct inode *inode, struct file *file){
+   int ret = seq_open(file, &mp1_seq_ops);
+
+   if (!ret)
+      ((struct seq_file *)file->private_data)->private = (void *)MP1_MODE_TEXT;
+   return ret;
+}
+
+// Recently Exited File Iterator
+// Positions are absolute ring sequence numbers, a reader that fell behind
+//   resumes at the oldest record still in the ring
+static void *mp1_exited_start(struct seq_file *m, loff_t *pos){
+   unsigned long oldest;
+
+   spin_lock(&exited_lock);
+   oldest = exited_head > exited_ring_size ? exited_head - exited_ring_size : 0;
+   if (*pos < oldest)
+      *pos = oldest;
+   if (*pos >= exited_head)
+      return NULL;
+   return &exited_ring[(unsigned long)*pos % exited_ring_size];
+}
+
+static void *mp1_exited_next(struct seq_file *m, void *v, loff_t *pos){
+   ++*pos;
+   if (*pos >= exited_head)
+      return NULL;
+   return &exited_ring[(unsigned long)*pos % exited_ring_size];
+}
+
+static void mp1_exited_stop(struct seq_file *m, void *v){
+   spin_unlock(&exited_lock);
+}
+
+static int mp1_exited_show(struct seq_file *m, void *v){
+   struct mp1_exited *record = v;
+
+   seq_printf(m, "%d: %lu %lu %lu %lu %llu %llu\n", record->pid, record->sample.utime,
+              record->sample.stime, record->sample.nvcsw, record->sample.nivcsw,
+              record->sample.wall_ns, record->exit_ns);
+   return 0;
+}
+
+static const struct seq_operations mp1_exited_seq_ops = {
+   .start = mp1_exited_start,
+   .next = mp1_exited_next,
+   .stop = mp1_exited_stop,
+   .show = mp1_exited_show,
+};
+
+static int mp1_exited_open(struct inode *inode, struct file *file){
+   return seq_open(file, &mp1_exited_seq_ops);
+}
+
+static const struct file_operations mp1_exited_file = {
+   .owner = THIS_MODULE,
+   .open = mp1_exited_open,
+   .read = seq_read,
+   .llseek = seq_lseek,
+   .release = seq_release,
+};
+
+// Exit Notifier
+// Runs in the context of every exiting task, before its pid is detached
+// Untracked tasks cost one RCU hash lookup, tracked tasks are removed right
+//   away with their final cpu times, so short jobs are accounted and a
+//   recycled pid can never inherit the entry
+static int mp1_task_exit(struct notifier_block *nb, unsigned long val, void *data){
+   struct task_struct *task = data;
+   struct pid *pid_ref = task_pid(task);
+   struct mp1_sample sample;
+   struct pid_list *entry;
+   bool tracked;
+
+   rcu_read_lock();
+   tracked = pid_index_find(pid_ref) != NULL;
+   rcu_read_unlock();
+   if (!tracked)
+      return NOTIFY_OK;
+
+   spin_lock(&lock);
+   entry = pid_index_find(pid_ref);
+   if (entry) {
+      if (DEBUG) printk(KERN_ALERT "PID %d EXITED\n", entry->pid);
+      rcu_read_lock();
+      mp1_sample_task(task, &sample);
+      rcu_read_unlock();
+      mp1_exited_push(entry->pid, &sample);
+      pid_index_remove(entry);
+   }
+   spin_unlock(&lock);
+   return NOTIFY_OK;
+}
+
+static struct notifier_block mp1_exit_nb = {
+   .notifier_call = mp1_task_exit,
+};
+static int exit_nb_registered;
+
+// Allocates a PID Index entry for pid outside of the lock
+//
+// RETURN new entry holding a reference on the pid, NULL if pid is not alive
+static struct pid_list *pid_index_alloc(int pid){
+   struct task_struct *task;
+   struct pid_list *entry;
+   struct pid *pid_ref;
+
+   pid_ref = find_get_pid(pid);
+   if (!pid_ref)
+      return NULL;
+
+   entry = kmalloc(sizeof(struct pid_list), GFP_KERNEL);
+   if (!entry) {
+      put_pid(pid_ref);
+      return NULL;
+   }
+   entry->pid = pid;
+   memset(&entry->sample, 0, sizeof(entry->sample));
+   seqcount_init(&entry->seq);
+   entry->pid_ref = pid_ref;
+
+   // Start on the CPU the task last ran on
+   rcu_read_lock();
+   task = pid_task(pid_ref, PIDTYPE_PID);
+   entry->cpu = task ? task_cpu(task) : raw_smp_processor_id();
+   rcu_read_unlock();
+   return entry;
+}
+
+// Adds a batch of entries to the PID Index with a single lock hold
+// Entries whose pid is already registered are freed
+static void pid_index_insert(struct pid_list **entries, int nr){
+   int i;
+
+   spin_lock(&lock);
+   for (i = 0; i < nr; i++) {
+      if (pid_index_find(entries[i]->pid_ref)) {
+         put_pid(entries[i]->pid_ref);
+         kfree(entries[i]);
+         continue;
+      }
+      hash_add_rcu(pid_table, &entries[i]->hnode, (unsigned long)entries[i]->pid_ref);
+      list_add_tail_rcu(&entries[i]->list, &pid_order);
+      pid_index_home(entries[i], entries[i]->cpu);
+      atomic_inc(&list_size);
+      if (DEBUG) printk(KERN_ALERT "RECEIVED PID: %d", entries[i]->pid);
+   }
+   spin_unlock(&lock);
+}
+
+// Registers a packed mp1_bin_write array of pids and switches file to binary reads
+//
+// RETURN 0 on success, negative errno otherwise
+static int mp1_write_binary(struct file *file, const char __user *buffer, size_t count){
+   struct mp1_bin_write header;
+   struct pid_list **entries;
+   s32 *pids;
+   u32 i, nr = 0;
+   int ret = 0;
+
+   if (copy_from_user(&header, buffer, sizeof(header)))
+      return -EFAULT;
+   if (header.nr_pids > MP1_BIN_MAX_PIDS ||
+       count < sizeof(header) + header.nr_pids * sizeof(s32))
+      return -EINVAL;
+
+   ((struct seq_file *)file->private_data)->private = (void *)MP1_MODE_BINARY;
+   if (!header.nr_pids)
+      return 0;
+
+   pids = kmalloc_array(header.nr_pids, sizeof(s32), GFP_KERNEL);
+   entries = kmalloc_array(header.nr_pids, sizeof(*entries), GFP_KERNEL);
+   if (!pids || !entries) {
+      ret = -ENOMEM;
+      goto out;
+   }
+   if (copy_from_user(pids, buffer + sizeof(header), header.nr_pids * sizeof(s32))) {
+      ret = -EFAULT;
+      goto out;
+   }
+
+   // Dead pids are skipped, the rest go in under one lock hold
+   for (i = 0; i < header.nr_pids; i++) {
+      entries[nr] = pid_index_alloc(pids[i]);
+      if (entries[nr])
+         nr++;
+   }
+   pid_index_insert(entries, nr);
+
+out:
+   kfree(entries);
+   kfree(pids);
+   return ret;
+}
+
+// Recieves PID from user and inserts a new pid_list struct into the PID Index
+// Accepts either a text pid or a binary mp1_bin_write batch
 // Must return copied count or will infinite loop
-// 
+//
 // copy_from_user reference: http://stackoverflow.com/questions/23433936/return-value-of-copy-from-user
 static ssize_t mp1_write(struct file *file, const char __user *buffer, size_t count, loff_t *data){
-   int to_copy;
+   char pid_str[32];
+   size_t len = min(count, sizeof(pid_str) - 1);
+   struct pid_list *entry;
+   u32 magic;
+   int pid, ret;
 
    if (DEBUG) printk(KERN_ALERT "RECEIVING PID");
-   // Initialize memory for new linked list object
-	tmp = (struct pid_list *)kmalloc(sizeof(struct pid_list), GFP_KERNEL);
-   tmp->runtime = 0;
-   char pid_str[count];
-   to_copy = copy_from_user(pid_str, buffer, count);
-   sscanf(pid_str,"%d%*s",&(tmp->pid));
-   // Add new object to list
-   spin_lock(&lock);
-   list_add_tail(&(tmp->list), &(head.list));
-   list_size++;
-   spin_unlock(&lock);
-   if (DEBUG) printk(KERN_ALERT "RECEIVED PID: %d",tmp->pid);
+   if (count >= sizeof(struct mp1_bin_write)) {
+      if (get_user(magic, (const u32 __user *)buffer))
+         return -EFAULT;
+      if (magic == MP1_BIN_MAGIC) {
+         ret = mp1_write_binary(file, buffer, count);
+         if (ret)
+            return ret;
+         *data += count;
+         return count;
+      }
+   }
+
+   if (copy_from_user(pid_str, buffer, len))
+      return -EFAULT;
+   pid_str[len] = '\0';
+   if (sscanf(pid_str, "%d", &pid) != 1)
+      return -EINVAL;
+
+   // Initialize memory for new PID Index object outside of the lock
+   entry = pid_index_alloc(pid);
+   if (!entry)
+      return -ESRCH;
+   pid_index_insert(&entry, 1);
 
-   *data += count - to_copy;
-   return count - to_copy;
+   *data += count;
+   return count;
 }
 
 static const struct file_operations mp1_file = {
    .owner = THIS_MODULE,
-   .read = mp1_read,
+   .open = mp1_open,
+   .read = seq_read,
    .write = mp1_write,
+   .llseek = seq_lseek,
+   .release = seq_release,
 };
 
- // Sets 5 seconds timer interrupt
- static void set_timer(void) {
-    int ret;
-    setup_timer(&my_timer, queue_timer_updates, 0);
-    ret = mod_timer(&my_timer, jiffies + msecs_to_jiffies(5000));
-    if (ret && DEBUG) printk(KERN_ALERT "ERROR IN MOD TIMER\n");
-    if (DEBUG) printk(KERN_ALERT "5 SECOND TO TIMER INTERRUPT");
- }
-
- // Interrupt Bottom Half
- // Updates Process Runtimes and Updates /proc/mp1/status file
- static void update_runtimes(void){
-    int ret;
-    unsigned long cpu_use;
-
-    if (DEBUG) printk(KERN_ALERT "UPDATING RUNTIMES\n");
-    spin_lock(&lock);
-    // Updates timings in linked list
-       // Loops through processes and updates timings
-       list_for_each_safe(pos, q, &head.list){
-          tmp = list_entry(pos, struct pid_list, list);
-          ret = get_cpu_use(tmp->pid, &cpu_use);
-          if (!ret) {
-             tmp->runtime = cpu_use;
-	  }else{
-		//Deletes processes that are killed from linked list
-       		list_del(pos);
-       		kfree(tmp);
-		list_size--;
-	  }
-       }
-    spin_unlock(&lock);
-    if (DEBUG) printk(KERN_ALERT "FINISHED UPDATING RUNTIMES\n");
- }
-
- // Interrupt Top Half
- // Queues work function to be done
- static void queue_timer_updates(void){
-    struct work_struct *work = (struct work_struct *)kmalloc(sizeof(struct work_struct), GFP_KERNEL);
-    if (work) {
-       INIT_WORK( (struct work_struct *)work, update_runtimes);
-       queue_work( queue, (struct work_struct *)work );
-    }
-    set_timer();
- }
+// Sampling period in jiffies
+static unsigned long mp1_period(void){
+   return msecs_to_jiffies(max(READ_ONCE(sample_period_ms), 1U));
+}
+
+// Per-CPU Bottom Half
+// Updates the runtimes of the tasks homed on this CPU for /proc/mp1/status
+// Tasks that moved are rehomed to the CPU they last ran on for the next pass
+// Exits are normally handled by mp1_task_exit, a task found dead here (no exit
+//   notifier support) is removed with its last sampled times once the sampler
+//   lock is dropped
+static void update_runtimes(struct work_struct *work){
+   struct mp1_sampler *sampler = container_of(to_delayed_work(work), struct mp1_sampler, work);
+   struct mp1_sampler *target;
+   struct pid_list *entry, *next;
+   struct task_struct *task;
+   struct mp1_sample sample;
+   LIST_HEAD(dead);
+   int cpu;
+
+   if (DEBUG) printk(KERN_ALERT "UPDATING RUNTIMES ON CPU %d\n", sampler->cpu);
+   rcu_read_lock();
+   spin_lock(&sampler->lock);
+   list_for_each_entry_safe(entry, next, &sampler->tasks, cpu_list){
+      task = pid_task(entry->pid_ref, PIDTYPE_PID);
+      if (!task) {
+         entry->cpu = -1;
+         list_move(&entry->cpu_list, &dead);
+         continue;
+      }
+      mp1_sample_task(task, &sample);
+      write_seqcount_begin(&entry->seq);
+      entry->sample = sample;
+      write_seqcount_end(&entry->seq);
+
+      // Never waits on another sampler, a busy target retries next pass
+      cpu = task_cpu(task);
+      if (cpu != sampler->cpu && cpumask_test_cpu(cpu, &sampling_cpus)) {
+         target = per_cpu_ptr(&samplers, cpu);
+         if (spin_trylock(&target->lock)) {
+            list_move_tail(&entry->cpu_list, &target->tasks);
+            WRITE_ONCE(entry->cpu, cpu);
+            spin_unlock(&target->lock);
+         }
+      }
+   }
+   spin_unlock(&sampler->lock);
+
+   //Deletes processes that are killed from the PID Index
+   if (!list_empty(&dead)) {
+      spin_lock(&lock);
+      list_for_each_entry_safe(entry, next, &dead, cpu_list) {
+         if (hash_hashed(&entry->hnode))
+            mp1_exited_push(entry->pid, &entry->sample);
+         pid_index_remove(entry);
+      }
+      spin_unlock(&lock);
+   }
+   rcu_read_unlock();
+
+   // Publish the pass and rearm
+   WRITE_ONCE(sampler->sample_ns, ktime_get_ns());
+   WRITE_ONCE(sampler->epoch, sampler->epoch + 1);
+   queue_delayed_work_on(sampler->cpu, queue, &sampler->work, mp1_period());
+   if (DEBUG) printk(KERN_ALERT "FINISHED UPDATING RUNTIMES\n");
+}
 
 // mp1_init - Called when module is loaded
 int __init mp1_init(void)
 {
+   struct mp1_sampler *sampler;
+   int cpu;
+
    #ifdef DEBUG
    printk(KERN_ALERT "MP1 MODULE LOADING\n");
    #endif
@@ -179,20 +714,45 @@ int __init mp1_init(void)
    // Initialize spinlock
    spin_lock_init(&lock);
 
-   // Creates /proc/mp1/status
-   proc_dir = proc_mkdir(DIRECTORY, NULL);
-   proc_entry = proc_create(FILENAME, 0666, proc_dir, &mp1_file);  
-   if (DEBUG) printk(KERN_ALERT "CREATED /proc/mp1/status \n");
+   // PID Index is statically initialized
+   if (DEBUG) printk(KERN_ALERT "INITIALIZE PID Index\n");
 
-   // initializes pid_list head
-   if (DEBUG) printk(KERN_ALERT "INITIALIZE pid_list head\n");
-   INIT_LIST_HEAD(&head.list);
+   // Allocate Recently Exited Ring
+   if (!exited_ring_size)
+      exited_ring_size = 1;
+   exited_ring = kcalloc(exited_ring_size, sizeof(struct mp1_exited), GFP_KERNEL);
+   if (!exited_ring)
+      return -ENOMEM;
 
    // Initialize Workqueue
-    queue = create_workqueue("runtime_updates");
+   queue = create_workqueue("runtime_updates");
+   if (!queue) {
+      kfree(exited_ring);
+      return -ENOMEM;
+   }
+
+   // Start one sampler per online CPU
+   get_online_cpus();
+   cpumask_copy(&sampling_cpus, cpu_online_mask);
+   for_each_cpu(cpu, &sampling_cpus) {
+      sampler = per_cpu_ptr(&samplers, cpu);
+      spin_lock_init(&sampler->lock);
+      INIT_LIST_HEAD(&sampler->tasks);
+      INIT_DELAYED_WORK(&sampler->work, update_runtimes);
+      sampler->cpu = cpu;
+      queue_delayed_work_on(cpu, queue, &sampler->work, mp1_period());
+   }
+   put_online_cpus();
+
+   // Creates /proc/mp1/status once the samplers can take registrations
+   proc_dir = proc_mkdir(DIRECTORY, NULL);
+   proc_entry = proc_create(FILENAME, 0666, proc_dir, &mp1_file);  
+   exited_entry = proc_create(EXITED_FILENAME, 0444, proc_dir, &mp1_exited_file);
+   if (DEBUG) printk(KERN_ALERT "CREATED /proc/mp1/status \n");
 
-   // Queue 5 second timer interrupt
-    set_timer();
+   // Hook process exit, without CONFIG_PROFILING the samplers still expire dead pids
+   exit_nb_registered = !profile_event_register(PROFILE_TASK_EXIT, &mp1_exit_nb);
+   if (!exit_nb_registered) printk(KERN_ALERT "MP1 EXIT NOTIFIER UNAVAILABLE, POLLING FOR EXITS\n");
 
    if (DEBUG) printk(KERN_ALERT "MP1 MODULE LOADED\n");
    return 0;   
@@ -201,30 +761,41 @@ int __init mp1_init(void)
 // mp1_exit - Called when module is unloaded
 void __exit mp1_exit(void)
 {
+   struct pid_list *entry, *next;
+   int cpu;
+
    #ifdef DEBUG
    printk(KERN_ALERT "MP1 MODULE UNLOADING\n");
    #endif
 
-   // Frees Timer_List
-    del_timer(&my_timer);
+   // Unhooks process exit, waits for running notifiers
+   if (exit_nb_registered)
+      profile_event_unregister(PROFILE_TASK_EXIT, &mp1_exit_nb);
+
+   // Stops the samplers, each one rearms itself so cancel synchronously
+   for_each_cpu(cpu, &sampling_cpus)
+      cancel_delayed_work_sync(&per_cpu_ptr(&samplers, cpu)->work);
 
    // Frees work queue
     flush_workqueue(queue);
     destroy_workqueue(queue);
     if (DEBUG) printk(KERN_ALERT "DELETED WORKQUEUE\n");
-   
-   // Deletes /proc/mp1/status
+
+   // Deletes /proc/mp1/status and /proc/mp1/exited
+   proc_remove(exited_entry);
    proc_remove(proc_entry);
    proc_remove(proc_dir);
    if (DEBUG) printk(KERN_ALERT "DELETED /proc/mp1/status\n");
-   
-   // Frees pid_list memory   
-   list_for_each_safe(pos, q, &head.list){
-       tmp = list_entry(pos, struct pid_list, list);
-       list_del(pos);
-       kfree(tmp);
-   }
-   if (DEBUG) printk(KERN_ALERT "DELETED pid_list struct\n");
+
+   // Frees PID Index memory, waits for pending RCU frees before unloading
+   spin_lock(&lock);
+   list_for_each_entry_safe(entry, next, &pid_order, list){
+       pid_index_remove(entry);
+   }
+   spin_unlock(&lock);
+   rcu_barrier();
+   kfree(exited_ring);
+   if (DEBUG) printk(KERN_ALERT "DELETED PID Index\n");
 
    if (DEBUG) printk(KERN_ALERT "MP1 MODULE UNLOADED\n");
 }
@@ -0,0 +1,77 @@
+#ifndef __MP1_STATUS_INCLUDE__
+#define __MP1_STATUS_INCLUDE__
+
+#include <linux/types.h>
+
+/**
+ * Binary interface for /proc/mp1/status
+ *
+ * Text stays the default: "<pid>" per write and one line per read record,
+ * "<pid>: <utime> <stime> <nvcsw> <nivcsw> <wall_ns>", so existing
+ * "<pid>: <runtime>" parsers keep working.
+ *
+ * Writing a struct mp1_bin_write registers every pid in the packed array with
+ * one syscall and switches that open file to binary reads. A write with
+ * nr_pids == 0 only switches the file to binary reads.
+ *
+ * A binary read returns one struct mp1_bin_header followed by packed
+ * struct mp1_bin_record entries until end of file.
+**/
+#define MP1_BIN_MAGIC 0x3150504dU /* "MPP1" */
+#define MP1_BIN_VERSION 2
+#define MP1_BIN_MAX_PIDS 4096
+
+/**
+ * Batched registration
+ *
+ * magic MP1_BIN_MAGIC
+ * nr_pids number of entries in pids
+ * pids packed pid array
+**/
+struct mp1_bin_write {
+   __u32 magic;
+   __u32 nr_pids;
+   __s32 pids[];
+};
+
+/**
+ * Snapshot header
+ *
+ * magic MP1_BIN_MAGIC
+ * version MP1_BIN_VERSION
+ * record_size sizeof(struct mp1_bin_record) as built into the module
+ * epoch number of completed sampling passes
+ * sample_ns CLOCK_MONOTONIC time of the last completed sampling pass
+**/
+struct mp1_bin_header {
+   __u32 magic;
+   __u16 version;
+   __u16 record_size;
+   __u64 epoch;
+   __u64 sample_ns;
+};
+
+/**
+ * Snapshot record
+ *
+ * pid registered pid
+ * utime user cpu time in cputime units
+ * stime system cpu time in cputime units
+ * nvcsw voluntary context switches
+ * nivcsw involuntary context switches
+ * wall_ns CLOCK_MONOTONIC time since the task started
+ *
+ * With the tgid_rollup module parameter set, every counter except wall_ns is
+ * summed over the whole thread group, exited threads included.
+**/
+struct mp1_bin_record {
+   __s32 pid;
+   __u32 reserved;
+   __u64 utime;
+   __u64 stime;
+   __u64 nvcsw;
+   __u64 nivcsw;
+   __u64 wall_ns;
+};
+
+#endif